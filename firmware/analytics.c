@@ -0,0 +1,126 @@
+#include "analytics.h"
+#include "regulator.h"
+#include "eeprom.h"
+#include "history.h"
+#include "clock.h"
+#include "usart.h"
+
+#include <stdint.h>
+
+/*
+ * History layout in data EEPROM: a header followed by a ring of daily
+ * entries, each the day's best power in deciwatts corrected to 25 C
+ * (0 if the panel was never tracked that day).
+ */
+static struct history history = {
+  .offset = EEPROM_HISTORY_OFFSET,
+  .magic = 0xa5a1,
+  .days = 365,
+  .entry_size = 2,
+  .header_size = 8,
+};
+
+static const uint32_t poll_interval_ms = 1000;
+static const int gamma_ppm_per_c = -4000;   // -0.4 %/C, crystalline silicon
+static const unsigned int baseline_days = 30;
+static const unsigned int soiling_days = 7;
+static const unsigned int soiling_percent = 90;      // of baseline
+static const unsigned int degradation_permille_per_year = 15;
+static const unsigned int degradation_min_days = 180;
+
+static uint32_t last_poll_ms;
+static uint16_t best_dw;  // today's best corrected power
+static bool day_pending;  // the day is over but its entry is not queued yet
+
+static bool soiling, degradation;
+static int decline_permille_per_year;
+static unsigned int last_ratio_percent;
+
+static uint16_t history_max(unsigned int from_age, unsigned int days)
+{
+  unsigned int n = history_count(&history);
+  uint16_t m = 0;
+  for (unsigned int a=from_age; a < from_age + days && a < n; a++) {
+    uint16_t v = eeprom_read_u16(history_entry(&history, a));
+    if (v > m) m = v;
+  }
+  return m;
+}
+
+static int end_of_day(void)
+{
+  if (!history_has_room(&history, 1))
+    return -1;
+  if (eeprom_write_u16(history_next(&history), best_dw) || history_commit(&history))
+    return -1;
+  best_dw = 0;
+
+  unsigned int n = history_count(&history);
+  uint16_t baseline = history_max(0, baseline_days);
+  uint16_t recent = history_max(0, soiling_days);
+  last_ratio_percent = baseline ? 100 * recent / baseline : 0;
+
+  // even the clearest of the last few days falls well short of the month
+  soiling = n >= baseline_days && baseline && last_ratio_percent < soiling_percent;
+
+  // compare this month's clear-day power with the oldest month on record
+  degradation = false;
+  decline_permille_per_year = 0;
+  if (n >= degradation_min_days) {
+    uint16_t oldest = history_max(n - baseline_days, baseline_days);
+    if (oldest) {
+      int decline = 1000 - 1000 * (int) baseline / oldest;
+      decline_permille_per_year = decline * 365 / (int) (n - baseline_days);
+      degradation = decline_permille_per_year > (int) degradation_permille_per_year;
+    }
+  }
+  return 0;
+}
+
+void analytics_poll(void)
+{
+  if (msTicks - last_poll_ms < poll_interval_ms)
+    return;
+  last_poll_ms = msTicks;
+
+  // retried until the EEPROM queue has room for the whole entry
+  if (history_day_over(&history))
+    day_pending = true;
+  if (day_pending && !end_of_day())
+    day_pending = false;
+
+  int t;
+  if (regulator_get_mode(&chan1) != MAX_POWER || regulator_get_temperature(&t))
+    return;
+
+  // 16.16 watts to deciwatts, corrected to 25 C
+  int64_t w = ((int64_t) regulator_get_vsense(&chan1) * regulator_get_isense(&chan1)) >> 16;
+  int32_t dw = (w * 10) >> 16;
+  int32_t factor_ppm = 1000000 + gamma_ppm_per_c * (t - 250) / 10;
+  if (factor_ppm <= 0) return;
+  dw = (int64_t) dw * 1000000 / factor_ppm;
+  if (dw > 0xffff) dw = 0xffff;
+  if (dw > best_dw) best_dw = dw;
+}
+
+bool analytics_soiling_detected(void)
+{
+  return soiling;
+}
+
+bool analytics_degradation_detected(void)
+{
+  return degradation;
+}
+
+void analytics_report(void)
+{
+  print_value("days recorded = ", history_count(&history), "\n");
+  print_value("today best = ", best_dw, " dW\n");
+  print_value("baseline = ", history_max(0, baseline_days), " dW\n");
+  print_value("last week / baseline = ", last_ratio_percent, " %\n");
+  print_value("decline = ", decline_permille_per_year < 0 ? 0 : decline_permille_per_year,
+              " permille/year\n");
+  usart_print(soiling ? "soiling detected\n" : "");
+  usart_print(degradation ? "degradation detected\n" : "");
+}
@@ -0,0 +1,18 @@
+#include <stdbool.h>
+
+/*
+ * Panel degradation and soiling detection
+ *
+ * Once a day the best temperature-corrected maximum power point seen on
+ * channel 1 is appended to a 365-day history in data EEPROM and compared
+ * with the clear-day baseline (the best day of the last month).
+ */
+
+// track the day's best operating point, call periodically from the main loop
+void analytics_poll(void);
+
+// latest verdicts
+bool analytics_soiling_detected(void);
+bool analytics_degradation_detected(void);
+
+void analytics_report(void);
@@ -0,0 +1,216 @@
+#include <libopencm3/stm32/l1/adc.h>
+
+#include "arcfault.h"
+#include "capture.h"
+#include "regulator.h"
+#include "events.h"
+#include "kv.h"
+#include "clock.h"
+#include "usart.h"
+#include "config.h"
+
+#define CAPTURE_LEN 128
+#define NUM_BANDS 6
+
+static const uint8_t isense1_ch = ADC_CHANNEL3;
+
+/*
+ * Goertzel bins k of a CAPTURE_LEN point burst, 289 Hz apart. The default
+ * 20 kHz PWM is above Nyquist, and its first six harmonics alias to 17.0,
+ * 3.0, 14.1, 5.9, 11.1 and 8.9 kHz; each bin is more than 900 Hz from all
+ * of them. The coefficients are 2 cos(2 pi k / CAPTURE_LEN) in Q14.
+ */
+static const struct {
+  uint8_t k;
+  int16_t coeff;
+} bands[NUM_BANDS] = {
+  { 15,  24279 },  // 4.3 kHz
+  { 25,  11039 },  // 7.2 kHz
+  { 34,  -3212 },  // 9.8 kHz
+  { 43, -16846 },  // 12.4 kHz
+  { 53, -28106 },  // 15.3 kHz
+  { 63, -32729 },  // 18.2 kHz
+};
+
+static const uint32_t capture_interval_ms = 100;
+static const unsigned int learn_captures = 64;
+static const unsigned int baseline_shift = 6;  // baseline tracks at 1/64
+static const uint32_t band_threshold = 8;      // times the baseline, 9 dB
+static const unsigned int bands_to_flag = 4;   // of NUM_BANDS
+static const unsigned int captures_to_trip = 6; // of the last 8
+static const fixed32_t min_current = 0x1999;  // 0.1 A, no arc without current
+
+static uint16_t samples[CAPTURE_LEN];
+static bool capturing;
+static uint32_t last_capture_ms;
+
+static enum arcfault_state state = ARCFAULT_LEARNING;
+static unsigned int learned;
+static uint32_t baseline[NUM_BANDS];
+static uint32_t energy[NUM_BANDS];
+static uint8_t history;  // one bit per capture, set if flagged
+static unsigned int trips;
+
+static bool loaded;
+
+static unsigned int inject_amplitude;
+static uint32_t lfsr = 0xace1;
+
+static void inject_noise(void)
+{
+  for (unsigned int i=0; i<CAPTURE_LEN; i++) {
+    lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & 0xb400);
+    int v = samples[i] + (int) (lfsr % (2 * inject_amplitude + 1)) - (int) inject_amplitude;
+    samples[i] = v < 0 ? 0 : v > 0xfff ? 0xfff : v;
+  }
+}
+
+// band energies of the burst with its mean removed, scaled down by 2^12
+static void measure(void)
+{
+  int32_t mean = 0;
+  for (unsigned int i=0; i<CAPTURE_LEN; i++)
+    mean += samples[i];
+  mean /= CAPTURE_LEN;
+
+  for (unsigned int b=0; b<NUM_BANDS; b++) {
+    int32_t c = bands[b].coeff, s1 = 0, s2 = 0;
+    for (unsigned int i=0; i<CAPTURE_LEN; i++) {
+      int32_t s0 = samples[i] - mean + (int32_t) (((int64_t) c * s1) >> 14) - s2;
+      s2 = s1;
+      s1 = s0;
+    }
+    int64_t p = (int64_t) s1 * s1 + (int64_t) s2 * s2 - (((int64_t) c * s1 >> 14) * s2);
+    energy[b] = p < 0 ? 0 : p >> 12;
+  }
+}
+
+static void trip(unsigned int flagged_mask)
+{
+  state = ARCFAULT_TRIPPED;
+  trips++;
+  regulator_set_mode(&chan1, DISABLED);
+  event_log(EVENT_ARC_FAULT, flagged_mask);
+}
+
+static void evaluate(void)
+{
+  measure();
+
+  if (state == ARCFAULT_LEARNING) {
+    for (unsigned int b=0; b<NUM_BANDS; b++)
+      baseline[b] += (int32_t) (energy[b] - baseline[b]) / (int32_t) (learned + 1);
+    if (++learned >= learn_captures) {
+      state = ARCFAULT_ARMED;
+#if CONFIG_KV
+      kv_set(KV_ARC_BASELINE, baseline, sizeof(baseline));
+#endif
+    }
+    return;
+  }
+
+  unsigned int flagged = 0, mask = 0;
+  for (unsigned int b=0; b<NUM_BANDS; b++) {
+    if (energy[b] > band_threshold * (baseline[b] + 1)) {
+      flagged++;
+      mask |= 1 << b;
+    }
+  }
+
+  history <<= 1;
+  if (flagged >= bands_to_flag) {
+    history |= 1;
+    if ((unsigned int) __builtin_popcount(history) >= captures_to_trip)
+      trip(mask);
+  } else {
+    // only quiet captures move the baseline, so a slowly growing arc
+    // can't teach the detector that it is normal
+    for (unsigned int b=0; b<NUM_BANDS; b++)
+      baseline[b] += ((int32_t) (energy[b] - baseline[b])) >> baseline_shift;
+  }
+}
+
+void arcfault_poll(void)
+{
+  // a baseline learned before the last reset arms the detector at once
+  if (!loaded) {
+    loaded = true;
+#if CONFIG_KV
+    if (kv_get(KV_ARC_BASELINE, baseline, sizeof(baseline)) == sizeof(baseline))
+      state = ARCFAULT_ARMED;
+#endif
+  }
+
+  if (capturing) {
+    if (capture_busy())
+      return;
+    capturing = false;
+    if (inject_amplitude)
+      inject_noise();
+    if (state != ARCFAULT_TRIPPED)
+      evaluate();
+    return;
+  }
+
+  if (state == ARCFAULT_TRIPPED || msTicks - last_capture_ms < capture_interval_ms)
+    return;
+  last_capture_ms = msTicks;
+
+  if (regulator_get_mode(&chan1) == DISABLED || regulator_get_isense(&chan1) < min_current) {
+    history <<= 1;
+    return;
+  }
+  if (capture_start(isense1_ch, samples, CAPTURE_LEN) == 0)
+    capturing = true;
+}
+
+void arcfault_rearm(void)
+{
+  state = ARCFAULT_LEARNING;
+  learned = 0;
+  history = 0;
+  for (unsigned int b=0; b<NUM_BANDS; b++)
+    baseline[b] = 0;
+}
+
+void arcfault_inject(unsigned int amplitude)
+{
+  inject_amplitude = amplitude > 0x7ff ? 0x7ff : amplitude;
+}
+
+enum arcfault_state arcfault_get_state(void)
+{
+  return state;
+}
+
+void arcfault_report(void)
+{
+  static const char *const states[] = { "learning", "armed", "tripped" };
+  char buf[12];
+
+  usart_print("state = ");
+  usart_print(states[state]);
+  usart_print("\ntrips = ");
+  itoa(buf, 10, trips);
+  usart_print(buf);
+  usart_print("\nband   kHz  energy  baseline\n");
+  for (unsigned int b=0; b<NUM_BANDS; b++) {
+    itoa(buf, 4, b);
+    usart_print(buf);
+    itoa(buf, 6, (uint32_t) bands[b].k * CAPTURE_RATE / CAPTURE_LEN / 1000);
+    usart_print(buf);
+    itoa(buf, 8, energy[b]);
+    usart_print(buf);
+    itoa(buf, 10, baseline[b]);
+    usart_print(buf);
+    usart_print("\n");
+  }
+
+  struct event ev;
+  if (event_get(0, &ev) == 0 && ev.type == EVENT_ARC_FAULT) {
+    usart_print("last arc fault at ");
+    itoa(buf, 10, ev.time_s);
+    usart_print(buf);
+    usart_print(" s\n");
+  }
+}
@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Series arc-fault detection
+ *
+ * A series arc in the panel wiring adds broadband noise to the channel 1
+ * current up to the tens of kHz. Bursts of isense1 are captured at
+ * CAPTURE_RATE and their energy measured in a few bands chosen between
+ * the aliases of the PWM harmonics. Each band's normal level is learned; when most bands
+ * stay well above it for several captures in a row channel 1 is disabled
+ * and the event logged. The detector stays tripped until re-armed, and
+ * the learned levels are kept across resets.
+ */
+
+enum arcfault_state { ARCFAULT_LEARNING, ARCFAULT_ARMED, ARCFAULT_TRIPPED };
+
+// capture and evaluate periodically, call from the main loop
+void arcfault_poll(void);
+
+// clear a trip and relearn the baseline
+void arcfault_rearm(void);
+
+// add synthetic broadband noise of the given amplitude (ADC codes) to the
+// following captures, 0 to stop; exercises the detector on the bench
+void arcfault_inject(unsigned int amplitude);
+
+enum arcfault_state arcfault_get_state(void);
+
+void arcfault_report(void);
@@ -0,0 +1,145 @@
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/cortex.h>
+#include <string.h>
+
+#include "bench.h"
+#include "usart.h"
+#include "regulator.h"
+#include "io_expander.h"
+#include "config.h"
+#include "biquad.h"
+#include "mpc.h"
+#include "kv.h"
+#include "clock.h"
+
+#define DEMCR           MMIO32(0xE000EDFC)
+#define DEMCR_TRCENA    (1 << 24)
+#define DWT_CTRL        MMIO32(0xE0001000)
+#define DWT_CTRL_CYCCNTENA (1 << 0)
+#define DWT_CYCCNT      MMIO32(0xE0001004)
+
+// operands are volatile so the kernels are not folded away
+static volatile fixed32_t a = 0x18000, b = 0x2c000, r;
+static char buf[24];
+
+static void k_empty(void) { }
+static void k_fixed_mul(void) { r = ((int64_t) a * b) >> 16; }
+static void k_fixed_div(void) { r = ((int64_t) a << 16) / b; }
+static void k_fb_const_duty(void) { regulator_bench_feedback(&chan1, CONST_DUTY); }
+static void k_fb_voltage(void) { regulator_bench_feedback(&chan1, VOLTAGE_FB); }
+static void k_fb_current(void) { regulator_bench_feedback(&chan1, CURRENT_FB); }
+static void k_fb_max_power(void) { regulator_bench_feedback(&chan1, MAX_POWER); }
+#if CONFIG_MPC
+static void k_fb_mpc(void) { regulator_bench_feedback(&chan1, MPC_FB); }
+static void k_mpc_worst(void)
+{
+  // passes every constraint of each region but the last, so that all of
+  // them are evaluated; duty2 above duty1 is not a reachable state, but
+  // none that is reaches as far into the table
+  static const int32_t x[MPC_STATES] = { -5, 1000, 0xffff - 1000 };
+  int32_t u[MPC_INPUTS];
+  mpc_evaluate(&mpc_chan1_law, x, u);
+}
+#endif
+static void k_set_pwm_duty(void) { regulator_bench_pwm(); }
+static void k_itoa(void) { itoa(buf, 10, a); }
+static void k_timestamp(void) { format_timestamp(buf, 0x123456789ULL); }
+static const uint8_t record[KV_MAX_VALUE] = { 0x5a };
+static void k_crc16(void) { r = crc16(0xffff, record, sizeof(record)); }
+static void k_led_frame(void) { set_led(6, led_on); }
+#if CONFIG_BIQUAD
+static struct biquad_chain chain;
+static void k_biquad(void) { r = biquad_chain_step(&chain, a); }
+#endif
+
+struct bench_kernel {
+  const char *name;
+  void (*func)(void);
+  unsigned int iterations;
+};
+
+static const struct bench_kernel kernels[] = {
+  { "fixed32 multiply",     k_fixed_mul,     100 },
+  { "fixed32 divide",       k_fixed_div,     100 },
+  { "feedback const duty",  k_fb_const_duty, 100 },
+  { "feedback voltage",     k_fb_voltage,    100 },
+  { "feedback current",     k_fb_current,    100 },
+  { "feedback max power",   k_fb_max_power,  100 },
+#if CONFIG_MPC
+  { "feedback mpc",         k_fb_mpc,        100 },
+  { "mpc worst search",     k_mpc_worst,     100 },
+#endif
+  { "set_pwm_duty",         k_set_pwm_duty,  100 },
+  { "itoa",                 k_itoa,          100 },
+  { "format_timestamp",     k_timestamp,     100 },
+  { "crc16 kv record",      k_crc16,         100 },
+#if CONFIG_BIQUAD
+  { "biquad section",       k_biquad,        100 },
+#endif
+  { "led frame submit",     k_led_frame,     20 },
+};
+
+/* Average cycles per call of func, interrupts masked */
+static uint32_t measure(void (*func)(void), unsigned int n)
+{
+  cm_disable_interrupts();
+  uint32_t start = DWT_CYCCNT;
+  for (unsigned int i=0; i<n; i++)
+    func();
+  uint32_t cycles = DWT_CYCCNT - start;
+  cm_enable_interrupts();
+  return cycles / n;
+}
+
+/*
+ * An LED frame only completes from the I2C interrupt, which measure()
+ * masks, so while one is pending set_led just marks the shadow dirty.
+ * Each submission is timed on its own once the previous frame is done.
+ */
+static const uint32_t led_frame_wait_ms = 10;
+
+static uint32_t measure_led_frame(void (*func)(void), unsigned int n)
+{
+  uint32_t sum = 0;
+  for (unsigned int i=0; i<n; i++) {
+    uint32_t wait_start = msTicks;
+    while (leds_pending() && msTicks - wait_start < led_frame_wait_ms);
+    sum += measure(func, 1);
+  }
+  return sum / n;
+}
+
+void bench_run(void)
+{
+  DEMCR |= DEMCR_TRCENA;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
+  uint32_t overhead = measure(k_empty, 100);
+
+#if CONFIG_BIQUAD
+  struct biquad lowpass;
+  biquad_design_lowpass(&lowpass, 100, REGULATOR_LOOP_RATE, 71);
+  chain.n = 0;
+  biquad_chain_add(&chain, &lowpass);
+#endif
+
+  // the expander must already be enabled so the frame is just the submission
+  set_led(6, led_on);
+
+  usart_print("kernel                cycles/op\n");
+  for (unsigned int i=0; i<sizeof(kernels)/sizeof(kernels[0]); i++) {
+    uint32_t cycles = kernels[i].func == k_led_frame
+      ? measure_led_frame(kernels[i].func, kernels[i].iterations)
+      : measure(kernels[i].func, kernels[i].iterations);
+    cycles = cycles > overhead ? cycles - overhead : 0;
+    usart_print(kernels[i].name);
+    for (unsigned int len = strlen(kernels[i].name); len < 22; len++)
+      usart_print(" ");
+    itoa(buf, 10, cycles);
+    usart_print(buf);
+    usart_print("\n");
+  }
+
+  set_led(6, led_off);
+}
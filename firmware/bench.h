@@ -0,0 +1,7 @@
+/*
+ * On-device micro-benchmarks
+ *
+ * Runs a fixed set of kernels under the DWT cycle counter and prints the
+ * cycles per operation.
+ */
+void bench_run(void);
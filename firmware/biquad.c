@@ -0,0 +1,90 @@
+#include "biquad.h"
+
+#include <math.h>
+
+static const float pi = 3.14159265f;
+
+/* Direct form II transposed:
+ *
+ *   y  = b0 x + s1
+ *   s1 = b1 x - a1 y + s2
+ *   s2 = b2 x - a2 y
+ */
+int32_t biquad_chain_step(struct biquad_chain *chain, int32_t x)
+{
+  for (unsigned int i=0; i<chain->n; i++) {
+    const struct biquad *bq = &chain->sections[i];
+    int64_t acc = (int64_t) bq->b0 * x + chain->s1[i];
+    int32_t y = acc >> BIQUAD_FRAC_BITS;
+    chain->s1[i] = (int64_t) bq->b1 * x - (int64_t) bq->a1 * y + chain->s2[i];
+    chain->s2[i] = (int64_t) bq->b2 * x - (int64_t) bq->a2 * y;
+    x = y;
+  }
+  return x;
+}
+
+void biquad_chain_reset(struct biquad_chain *chain)
+{
+  for (unsigned int i=0; i<BIQUAD_MAX_SECTIONS; i++) {
+    chain->s1[i] = 0;
+    chain->s2[i] = 0;
+  }
+}
+
+int biquad_chain_add(struct biquad_chain *chain, const struct biquad *section)
+{
+  if (chain->n >= BIQUAD_MAX_SECTIONS) return -1;
+  chain->sections[chain->n] = *section;
+  chain->s1[chain->n] = 0;
+  chain->s2[chain->n] = 0;
+  chain->n++;
+  return 0;
+}
+
+// returns -1 if c does not fit Q4.27 (or is not a number)
+static int to_fixed(float c, int32_t *out)
+{
+  // just inside +-16, so that rounding cannot reach 1 << 31
+  const float limit = (1 << (31 - BIQUAD_FRAC_BITS)) - 0.001f;
+  if (!(c > -limit && c < limit))
+    return -1;
+  *out = lroundf(c * (1 << BIQUAD_FRAC_BITS));
+  return 0;
+}
+
+// bq is only written if every coefficient fits
+static int set_coeffs(struct biquad *bq, float b0, float b1, float b2,
+                      float a0, float a1, float a2)
+{
+  struct biquad tmp;
+  if (to_fixed(b0 / a0, &tmp.b0) || to_fixed(b1 / a0, &tmp.b1)
+      || to_fixed(b2 / a0, &tmp.b2) || to_fixed(a1 / a0, &tmp.a1)
+      || to_fixed(a2 / a0, &tmp.a2))
+    return -1;
+  *bq = tmp;
+  return 0;
+}
+
+int biquad_design_lowpass(struct biquad *bq, uint32_t fc, uint32_t fs, uint32_t q)
+{
+  float w0 = 2 * pi * fc / fs;
+  float alpha = sinf(w0) / (2 * q / 100.0f);
+  float c = cosf(w0);
+  return set_coeffs(bq, (1 - c) / 2, 1 - c, (1 - c) / 2, 1 + alpha, -2 * c, 1 - alpha);
+}
+
+int biquad_design_notch(struct biquad *bq, uint32_t f0, uint32_t fs, uint32_t q)
+{
+  float w0 = 2 * pi * f0 / fs;
+  float alpha = sinf(w0) / (2 * q / 100.0f);
+  float c = cosf(w0);
+  return set_coeffs(bq, 1, -2 * c, 1, 1 + alpha, -2 * c, 1 - alpha);
+}
+
+int biquad_design_lead_lag(struct biquad *bq, uint32_t fz, uint32_t fp, uint32_t fs)
+{
+  float wz = 2 * pi * fz, wp = 2 * pi * fp;
+  float c = 2.0f * fs;
+  float g = wp / wz;
+  return set_coeffs(bq, g * (c + wz), g * (wz - c), 0, c + wp, wp - c, 0);
+}
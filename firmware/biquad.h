@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+/*
+ * Fixed-point biquad filters
+ *
+ * Second-order sections in direct form II transposed. Coefficients are
+ * Q4.27 (range ±16) and the state is kept in 64-bit accumulators, so a
+ * section costs five 32x32->64 multiply-accumulates per sample.
+ */
+
+#define BIQUAD_FRAC_BITS 27
+#define BIQUAD_MAX_SECTIONS 3
+
+struct biquad {
+  int32_t b0, b1, b2, a1, a2; // a0 normalized to 1
+};
+
+struct biquad_chain {
+  unsigned int n;
+  struct biquad sections[BIQUAD_MAX_SECTIONS];
+  int64_t s1[BIQUAD_MAX_SECTIONS], s2[BIQUAD_MAX_SECTIONS];
+};
+
+int32_t biquad_chain_step(struct biquad_chain *chain, int32_t x);
+void biquad_chain_reset(struct biquad_chain *chain);
+// returns 0 on success, -1 if the chain is full
+int biquad_chain_add(struct biquad_chain *chain, const struct biquad *section);
+
+/*
+ * Coefficient design (bilinear transform). These use floating point and
+ * have no hardware dependencies, so they can equally be built on the host
+ * to generate coefficient tables offline.
+ *
+ * Frequencies are in Hz, fs is the control loop rate, q is Q * 100. Each
+ * returns 0, or -1 without touching bq if a coefficient falls outside the
+ * Q4.27 range.
+ */
+int biquad_design_lowpass(struct biquad *bq, uint32_t fc, uint32_t fs, uint32_t q);
+int biquad_design_notch(struct biquad *bq, uint32_t f0, uint32_t fs, uint32_t q);
+// first-order lead-lag with unity DC gain, zero at fz and pole at fp; the
+// high-frequency gain fp/fz must stay below 16
+int biquad_design_lead_lag(struct biquad *bq, uint32_t fz, uint32_t fp, uint32_t fs);
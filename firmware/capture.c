@@ -0,0 +1,50 @@
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/l1/adc.h>
+#include <libopencm3/cm3/nvic.h>
+
+#include "capture.h"
+
+static volatile bool busy;
+static uint8_t capture_channel;
+
+int capture_start(uint8_t channel, uint16_t *buf, unsigned int n)
+{
+  if (busy || !(RCC_APB2ENR & RCC_APB2ENR_ADC1EN))
+    return 1;
+  busy = true;
+  capture_channel = channel;
+
+  dma_channel_reset(DMA1, DMA_CHANNEL1);
+  dma_set_peripheral_address(DMA1, DMA_CHANNEL1, (uint32_t) &ADC1_DR);
+  dma_set_memory_address(DMA1, DMA_CHANNEL1, (uint32_t) buf);
+  dma_set_number_of_data(DMA1, DMA_CHANNEL1, n);
+  dma_set_read_from_peripheral(DMA1, DMA_CHANNEL1);
+  dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL1);
+  dma_set_peripheral_size(DMA1, DMA_CHANNEL1, DMA_CCR_PSIZE_16BIT);
+  dma_set_memory_size(DMA1, DMA_CHANNEL1, DMA_CCR_MSIZE_16BIT);
+  dma_set_priority(DMA1, DMA_CHANNEL1, DMA_CCR_PL_HIGH);
+  dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL1);
+  nvic_enable_irq(NVIC_DMA1_CHANNEL1_IRQ);
+  dma_enable_channel(DMA1, DMA_CHANNEL1);
+
+  adc_set_regular_sequence(ADC1, 1, &capture_channel);
+  adc_set_continuous_conversion_mode(ADC1);
+  adc_enable_dma(ADC1);
+  adc_start_conversion_regular(ADC1);
+  return 0;
+}
+
+bool capture_busy(void)
+{
+  return busy;
+}
+
+void dma1_channel1_isr(void)
+{
+  dma_clear_interrupt_flags(DMA1, DMA_CHANNEL1, DMA_TCIF);
+  dma_disable_channel(DMA1, DMA_CHANNEL1);
+  adc_set_single_conversion_mode(ADC1);
+  adc_disable_dma(ADC1);
+  busy = false;
+}
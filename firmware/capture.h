@@ -0,0 +1,19 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Fast ADC burst capture
+ *
+ * Converts one ADC channel back-to-back as regular conversions, moving
+ * the samples to memory with DMA1 channel 1. The injected control-loop
+ * conversions keep priority and simply delay the burst by one slot when
+ * they fire. The burst uses the control loop's sample time, which is set
+ * per channel and so shared with the injected conversions.
+ */
+
+// ADCCLK / (96 cycles sampling + 12 cycles conversion)
+#define CAPTURE_RATE (4000000 / (96 + 12))
+
+// returns 0 if started, nonzero if the ADC is off or a capture is running
+int capture_start(uint8_t channel, uint16_t *buf, unsigned int n);
+bool capture_busy(void);
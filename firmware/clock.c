@@ -1,8 +1,13 @@
+#include "config.h"
 #include "clock.h"
+#include "power.h"
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
 
 volatile uint32_t msTicks;      /* counts 1ms timeTicks */
+static volatile uint32_t us_overflows; /* TIM6 wraps, upper bits of monotonic_us */
 
 void init_systick()
 {
@@ -17,6 +22,56 @@ void delay_ms(unsigned int ms) {
     while ((msTicks - curTicks) < ms);
 }
 
+/*
+ * Monotonic microsecond clock
+ *
+ * TIM6 free-runs at 1 MHz; its 16-bit counter is extended to 64 bits by
+ * counting update events, so the clock never wraps in practice.
+ */
+void init_us_clock(void)
+{
+    power_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM6EN);
+    timer_reset(TIM6);
+    timer_set_prescaler(TIM6, CLOCKRATE / 1000000 - 1);
+    timer_set_period(TIM6, 0xffff);
+    timer_update_on_overflow(TIM6);
+    // PSC is preloaded: load it now rather than at the first overflow,
+    // and don't count this update as one
+    timer_generate_event(TIM6, TIM_EGR_UG);
+    timer_clear_flag(TIM6, TIM_SR_UIF);
+    timer_enable_irq(TIM6, TIM_DIER_UIE);
+    nvic_enable_irq(NVIC_TIM6_IRQ);
+    timer_enable_counter(TIM6);
+}
+
+uint64_t monotonic_us(void)
+{
+    uint32_t hi, lo;
+    bool pending;
+    do {
+        hi = us_overflows;
+        lo = timer_get_counter(TIM6);
+        pending = timer_get_flag(TIM6, TIM_SR_UIF);
+    } while (hi != us_overflows);
+
+    // wrapped but tim6_isr has not run yet (interrupts masked or we
+    // are in a higher priority handler)
+    if (pending && lo < 0x8000)
+        hi++;
+    return ((uint64_t) hi << 16) | lo;
+}
+
+uint32_t uptime_us(void)
+{
+    return monotonic_us();
+}
+
+void tim6_isr(void)
+{
+    timer_clear_flag(TIM6, TIM_SR_UIF);
+    us_overflows++;
+}
+
 void sys_tick_handler(void) {
     msTicks++;
 }
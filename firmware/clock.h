@@ -5,6 +5,10 @@ extern volatile uint32_t msTicks;      /* counts 1ms timeTicks */
 void init_systick(void);
 void delay_ms(unsigned int ms);
 
+void init_us_clock(void);
+uint64_t monotonic_us(void);   /* microseconds since init_us_clock */
+uint32_t uptime_us(void);      /* low 32 bits of monotonic_us */
+
 // Using 16MHz HSI clock
 #define CLOCKRATE 16000000
 
@@ -0,0 +1,80 @@
+/*
+ * Build-time feature selection
+ *
+ * Each optional subsystem is guarded by a CONFIG_* switch. The Makefile
+ * passes the values chosen by the selected configuration in configs/;
+ * the defaults below only apply when building outside of it.
+ */
+
+#ifndef CONFIG_POWER
+#define CONFIG_POWER 1            // MCU power-state and clock accounting
+#endif
+
+#ifndef CONFIG_BOOT_ANIMATION
+#define CONFIG_BOOT_ANIMATION 1   // LED chase at startup
+#endif
+
+#ifndef CONFIG_ADAPTIVE_RATE
+#define CONFIG_ADAPTIVE_RATE 1    // slow the control loop at steady state
+#endif
+
+#ifndef CONFIG_BENCH
+#define CONFIG_BENCH 1            // on-device micro-benchmark command
+#endif
+
+#ifndef CONFIG_BIQUAD
+#define CONFIG_BIQUAD 1           // biquad filters on the feedback error
+#endif
+
+#ifndef CONFIG_GAIN_SCHEDULE
+#define CONFIG_GAIN_SCHEDULE 1    // gains scheduled on duty and vsense
+#endif
+
+#ifndef CONFIG_MPC
+#define CONFIG_MPC 1              // experimental explicit MPC on channel 1
+#endif
+
+#ifndef CONFIG_LIGHTING
+#define CONFIG_LIGHTING 1         // channel 2 LED lighting driver
+#endif
+
+#ifndef CONFIG_ANALYTICS
+#define CONFIG_ANALYTICS 1        // panel degradation and soiling detection
+#endif
+
+#ifndef CONFIG_ARCFAULT
+#define CONFIG_ARCFAULT 1         // series arc-fault detection on channel 1
+#endif
+
+#ifndef CONFIG_HEALTH
+#define CONFIG_HEALTH 1           // output capacitor and inductor health
+#endif
+
+#ifndef CONFIG_TELEMETRY
+#define CONFIG_TELEMETRY 1        // binary telemetry frames by subscription
+#endif
+
+#ifndef CONFIG_SAMPLER
+#define CONFIG_SAMPLER 1          // live sampling of RAM into telemetry
+#endif
+
+#ifndef CONFIG_JOBS
+#define CONFIG_JOBS 1             // background jobs with asynchronous results
+#endif
+
+#ifndef CONFIG_SENSORS
+#define CONFIG_SENSORS 1          // I2C sensors on the LED expander bus
+#endif
+
+#ifndef CONFIG_KV
+#define CONFIG_KV 1               // key-value store, lifetime energy
+#endif
+
+// ADC burst capture and the event log, shared by the features using them
+#define CONFIG_CAPTURE (CONFIG_ARCFAULT || CONFIG_HEALTH)
+// data EEPROM, likewise
+#define CONFIG_EEPROM (CONFIG_ANALYTICS || CONFIG_HEALTH || CONFIG_KV || CONFIG_CAPTURE)
+
+#if CONFIG_SAMPLER && !CONFIG_TELEMETRY
+#error "CONFIG_SAMPLER requires CONFIG_TELEMETRY"
+#endif
@@ -0,0 +1,18 @@
+# Bench and debugging: everything enabled, unoptimized
+CONFIG_POWER          ?= y
+CONFIG_BOOT_ANIMATION ?= y
+CONFIG_ADAPTIVE_RATE  ?= y
+CONFIG_BENCH          ?= y
+CONFIG_BIQUAD         ?= y
+CONFIG_GAIN_SCHEDULE  ?= y
+CONFIG_MPC            ?= y
+CONFIG_LIGHTING       ?= y
+CONFIG_ANALYTICS      ?= y
+CONFIG_ARCFAULT       ?= y
+CONFIG_HEALTH         ?= y
+CONFIG_TELEMETRY      ?= y
+CONFIG_SAMPLER        ?= y
+CONFIG_JOBS           ?= y
+CONFIG_SENSORS        ?= y
+CONFIG_KV             ?= y
+OPT                   ?= -O0
@@ -0,0 +1,18 @@
+# Regulation and console only
+CONFIG_POWER          ?= n
+CONFIG_BOOT_ANIMATION ?= n
+CONFIG_ADAPTIVE_RATE  ?= n
+CONFIG_BENCH          ?= n
+CONFIG_BIQUAD         ?= n
+CONFIG_GAIN_SCHEDULE  ?= n
+CONFIG_MPC            ?= n
+CONFIG_LIGHTING       ?= n
+CONFIG_ANALYTICS      ?= n
+CONFIG_ARCFAULT       ?= n
+CONFIG_HEALTH         ?= n
+CONFIG_TELEMETRY      ?= n
+CONFIG_SAMPLER        ?= n
+CONFIG_JOBS           ?= n
+CONFIG_SENSORS        ?= n
+CONFIG_KV             ?= n
+OPT                   ?= -Os
@@ -0,0 +1,122 @@
+#include <libopencm3/cm3/common.h>
+
+#include "eeprom.h"
+#include "regulator.h"
+
+#define EEPROM_BASE     0x08080000
+
+#define FLASH_PECR      MMIO32(0x40023C04)
+#define FLASH_PEKEYR    MMIO32(0x40023C0C)
+#define FLASH_SR        MMIO32(0x40023C18)
+#define FLASH_PECR_PELOCK (1 << 0)
+#define FLASH_PECR_FTDW   (1 << 8)
+#define FLASH_SR_BSY      (1 << 0)
+#define FLASH_SR_ERRORS   (0x1f << 8)
+
+static const unsigned int isr_margin_us = 200; // conversion and loop update
+
+struct pending_write {
+  uint16_t offset;
+  uint8_t size;
+  uint32_t val;
+};
+
+static struct pending_write queue[EEPROM_QUEUE_LEN];
+static unsigned int queue_head, queue_count;
+
+bool eeprom_can_write(void)
+{
+  return regulator_get_loop_slack_us() >= EEPROM_WRITE_US + isr_margin_us;
+}
+
+static void unlock(void)
+{
+  if (FLASH_PECR & FLASH_PECR_PELOCK) {
+    FLASH_PEKEYR = 0x89ABCDEF;
+    FLASH_PEKEYR = 0x02030405;
+  }
+  // always erase before programming, so the write time is fixed
+  FLASH_PECR |= FLASH_PECR_FTDW;
+}
+
+static int finish(void)
+{
+  while (FLASH_SR & FLASH_SR_BSY);
+  int err = FLASH_SR & FLASH_SR_ERRORS;
+  FLASH_SR = FLASH_SR_ERRORS; // write 1 to clear
+  FLASH_PECR |= FLASH_PECR_PELOCK;
+  return err ? -1 : 0;
+}
+
+uint8_t eeprom_read_u8(uint32_t offset)
+{
+  uint8_t b = *(volatile uint8_t *) (EEPROM_BASE + offset);
+  // the latest queued write covering the byte wins
+  for (unsigned int i=0; i<queue_count; i++) {
+    const struct pending_write *w = &queue[(queue_head + i) % EEPROM_QUEUE_LEN];
+    if (offset >= w->offset && offset < (uint32_t) w->offset + w->size)
+      b = w->val >> (8 * (offset - w->offset));
+  }
+  return b;
+}
+
+uint16_t eeprom_read_u16(uint32_t offset)
+{
+  return eeprom_read_u8(offset) | (uint16_t) eeprom_read_u8(offset + 1) << 8;
+}
+
+uint32_t eeprom_read_u32(uint32_t offset)
+{
+  return eeprom_read_u16(offset) | (uint32_t) eeprom_read_u16(offset + 2) << 16;
+}
+
+static int enqueue(uint32_t offset, uint8_t size, uint32_t val)
+{
+  if (queue_count == EEPROM_QUEUE_LEN) return -1;
+  struct pending_write *w = &queue[(queue_head + queue_count) % EEPROM_QUEUE_LEN];
+  w->offset = offset;
+  w->size = size;
+  w->val = val;
+  queue_count++;
+  return 0;
+}
+
+int eeprom_write_u16(uint32_t offset, uint16_t val)
+{
+  if (offset + 2 > EEPROM_SIZE || offset % 2) return -1;
+  if (eeprom_read_u16(offset) == val) return 0;
+  return enqueue(offset, 2, val);
+}
+
+int eeprom_write_u32(uint32_t offset, uint32_t val)
+{
+  if (offset + 4 > EEPROM_SIZE || offset % 4) return -1;
+  if (eeprom_read_u32(offset) == val) return 0;
+  return enqueue(offset, 4, val);
+}
+
+unsigned int eeprom_pending(void)
+{
+  return queue_count;
+}
+
+unsigned int eeprom_free(void)
+{
+  return EEPROM_QUEUE_LEN - queue_count;
+}
+
+void eeprom_poll(void)
+{
+  if (!queue_count || !eeprom_can_write())
+    return;
+
+  const struct pending_write *w = &queue[queue_head];
+  unlock();
+  if (w->size == 2)
+    *(volatile uint16_t *) (EEPROM_BASE + w->offset) = w->val;
+  else
+    *(volatile uint32_t *) (EEPROM_BASE + w->offset) = w->val;
+  finish();
+  queue_head = (queue_head + 1) % EEPROM_QUEUE_LEN;
+  queue_count--;
+}
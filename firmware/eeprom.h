@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Data EEPROM
+ *
+ * The STM32L151x6 has 4 kB of data EEPROM, addressed here by byte offset.
+ * Each write programs in about 3.3 ms during which the flash interface is
+ * busy and instruction fetches, including the control loop interrupt's,
+ * stall. Writes are therefore queued in RAM and programmed by eeprom_poll
+ * only in a gap between control loop samples long enough to hold them.
+ * The gap is measured in TIM7 ticks. At the full loop rate of 1 ms there
+ * is none, so writes wait until the loop slows to a quarter of it or
+ * both channels are off. Reads see queued writes.
+ */
+
+#define EEPROM_WRITE_US 3400
+#define EEPROM_QUEUE_LEN 24
+
+#define EEPROM_SIZE 4096
+
+/* Allocation of the data EEPROM */
+#define EEPROM_HISTORY_OFFSET 0     // panel analytics, 0x300 bytes
+#define EEPROM_EVENTS_OFFSET 0x300  // event log, 0x84 bytes
+#define EEPROM_HEALTH_OFFSET 0x384  // capacitor and inductor health, 0x210 bytes
+#define EEPROM_KV_OFFSET 0x600      // key-value store, 0xa00 bytes
+
+uint8_t eeprom_read_u8(uint32_t offset);
+uint16_t eeprom_read_u16(uint32_t offset);
+uint32_t eeprom_read_u32(uint32_t offset);
+
+// whether a write started now would finish before the next loop sample
+bool eeprom_can_write(void);
+
+// returns 0 if the value was queued (or is already stored), -1 if the
+// offset is invalid or the queue is full
+int eeprom_write_u16(uint32_t offset, uint16_t val);
+int eeprom_write_u32(uint32_t offset, uint32_t val);
+
+// writes waiting to be programmed
+unsigned int eeprom_pending(void);
+// writes that can still be queued, check it before a record that must
+// land whole
+unsigned int eeprom_free(void);
+
+// program the oldest queued write if there is a gap, call from the main loop
+void eeprom_poll(void);
@@ -0,0 +1,41 @@
+#include "events.h"
+#include "eeprom.h"
+#include "clock.h"
+
+#define HDR_HEAD  (EEPROM_EVENTS_OFFSET + 0)
+#define HDR_COUNT (EEPROM_EVENTS_OFFSET + 2)
+#define ENTRIES   (EEPROM_EVENTS_OFFSET + 4)
+#define EVENT_WRITES 4  // two entry words, head and count
+
+int event_log(enum event_type type, uint16_t data)
+{
+  unsigned int head = eeprom_read_u16(HDR_HEAD) % EVENT_LOG_LEN;
+  unsigned int count = eeprom_read_u16(HDR_COUNT);
+  uint32_t offset = ENTRIES + 8 * head;
+
+  // the header must never advance over an entry that was not queued
+  if (eeprom_free() < EVENT_WRITES)
+    return -1;
+  int ret = eeprom_write_u32(offset, monotonic_us() / 1000000);
+  ret |= eeprom_write_u32(offset + 4, type | ((uint32_t) data << 16));
+  if (ret)
+    return -1;
+  ret = eeprom_write_u16(HDR_HEAD, (head + 1) % EVENT_LOG_LEN);
+  if (count < EVENT_LOG_LEN)
+    ret |= eeprom_write_u16(HDR_COUNT, count + 1);
+  return ret;
+}
+
+int event_get(unsigned int age, struct event *ev)
+{
+  unsigned int count = eeprom_read_u16(HDR_COUNT);
+  if (count > EVENT_LOG_LEN || age >= count)
+    return 1;
+  unsigned int head = eeprom_read_u16(HDR_HEAD) % EVENT_LOG_LEN;
+  uint32_t offset = ENTRIES + 8 * ((head + EVENT_LOG_LEN - 1 - age) % EVENT_LOG_LEN);
+  uint32_t w = eeprom_read_u32(offset + 4);
+  ev->time_s = eeprom_read_u32(offset);
+  ev->type = w & 0xffff;
+  ev->data = w >> 16;
+  return 0;
+}
@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+/*
+ * Persistent event log
+ *
+ * A small ring of timestamped events in data EEPROM that survives resets,
+ * for faults that shut something down.
+ */
+
+enum event_type {
+  EVENT_NONE, EVENT_ARC_FAULT, EVENT_CAPACITOR_WEAR, EVENT_INDUCTOR_SATURATION,
+};
+
+struct event {
+  uint32_t time_s;  // uptime at the event
+  uint16_t type;
+  uint16_t data;
+};
+
+#define EVENT_LOG_LEN 16
+
+// returns 0 if the event was queued, -1 if the EEPROM queue had no room
+// for the whole record and it was dropped
+int event_log(enum event_type type, uint16_t data);
+// age 0 is the most recent, returns nonzero if there is no such event
+int event_get(unsigned int age, struct event *ev);
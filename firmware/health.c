@@ -0,0 +1,294 @@
+#include "health.h"
+#include "regulator.h"
+#include "capture.h"
+#include "events.h"
+#include "eeprom.h"
+#include "history.h"
+#include "clock.h"
+#include "usart.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_LEN 128
+#define PHASE_BINS 16
+#define BURSTS 8        // per waveform and measurement
+#define NUM_CHANNELS 2
+
+/*
+ * History in data EEPROM: the header holds the first day's values as the
+ * baseline, followed by a ring of daily averages for both channels.
+ */
+#define HDR_BASELINE (EEPROM_HEALTH_OFFSET + 8)
+
+static struct history history = {
+  .offset = EEPROM_HEALTH_OFFSET,
+  .magic = 0xa5c4,
+  .days = 64,
+  .entry_size = 4 * NUM_CHANNELS,
+  .header_size = 8 + 4 * NUM_CHANNELS,
+};
+
+static const uint32_t measurement_interval_ms = 10000;
+static const float min_ripple_a = 0.05f;     // too little excitation below this
+static const float low_current_a = 0.5f;     // inductance reference is learned below
+static const unsigned int saturation_percent = 70; // of the reference inductance
+static const unsigned int esr_limit_percent = 200;
+static const unsigned int cap_limit_percent = 80;
+
+struct channel_health {
+  struct regulator_t *reg;
+  uint16_t esr_mohm, cap_uf;  // latest estimate, 0 if none
+  uint16_t ripple_ma;         // latest inductor current ripple, peak-to-peak
+  uint16_t l_uh, l_ref_uh;    // latest and low-current inductance
+  uint16_t sat_onset_ma;      // lowest mean current with saturation, 0 if none
+  uint32_t esr_sum, cap_sum;  // for today's average
+  uint16_t day_count;
+  bool cap_worn;
+};
+
+static struct channel_health channels[NUM_CHANNELS] = {
+  { .reg = &chan1 },
+  { .reg = &chan2 },
+};
+
+static uint16_t samples[CAPTURE_LEN];
+static int32_t v_sum[PHASE_BINS], i_sum[PHASE_BINS];
+static uint16_t v_n[PHASE_BINS], i_n[PHASE_BINS];
+
+static struct channel_health *measuring;
+static unsigned int burst;  // first BURSTS are voltage, then current
+static bool capturing;
+static uint32_t last_measurement_ms;
+static bool day_pending;  // the day is over but its entry is not queued yet
+static unsigned int next_channel;
+
+static uint16_t baseline_esr(unsigned int ch)
+{
+  return history_count(&history) ? eeprom_read_u16(HDR_BASELINE + 4 * ch) : 0;
+}
+
+static uint16_t baseline_cap(unsigned int ch)
+{
+  return history_count(&history) ? eeprom_read_u16(HDR_BASELINE + 4 * ch + 2) : 0;
+}
+
+static int history_append(const uint16_t esr[NUM_CHANNELS], const uint16_t cap[NUM_CHANNELS])
+{
+  bool first = history_count(&history) == 0;
+  uint32_t entry = history_next(&history);
+  if (!history_has_room(&history, (first ? 4 : 2) * NUM_CHANNELS))
+    return -1;
+  int ret = 0;
+  for (unsigned int ch=0; ch<NUM_CHANNELS; ch++) {
+    if (first) {
+      ret |= eeprom_write_u16(HDR_BASELINE + 4 * ch, esr[ch]);
+      ret |= eeprom_write_u16(HDR_BASELINE + 4 * ch + 2, cap[ch]);
+    }
+    ret |= eeprom_write_u16(entry + 4 * ch, esr[ch]);
+    ret |= eeprom_write_u16(entry + 4 * ch + 2, cap[ch]);
+  }
+  return ret ? -1 : history_commit(&history);
+}
+
+// returns -1 if the EEPROM queue had no room, the day's sums are kept
+static int end_of_day(void)
+{
+  uint16_t esr[NUM_CHANNELS], cap[NUM_CHANNELS];
+  bool any = false;
+
+  for (unsigned int ch=0; ch<NUM_CHANNELS; ch++) {
+    struct channel_health *h = &channels[ch];
+    esr[ch] = h->day_count ? h->esr_sum / h->day_count : 0;
+    cap[ch] = h->day_count ? h->cap_sum / h->day_count : 0;
+    any |= esr[ch] || cap[ch];
+  }
+
+  // a channel first seen after the baseline was taken keeps no baseline
+  if (any && history_append(esr, cap))
+    return -1;
+  for (unsigned int ch=0; ch<NUM_CHANNELS; ch++)
+    channels[ch].esr_sum = channels[ch].cap_sum = channels[ch].day_count = 0;
+  if (!any) return 0;
+
+  for (unsigned int ch=0; ch<NUM_CHANNELS; ch++) {
+    struct channel_health *h = &channels[ch];
+    uint32_t esr0 = baseline_esr(ch), cap0 = baseline_cap(ch);
+    if (!esr0 || !cap0 || !esr[ch] || !cap[ch]) continue;
+    bool worn = 100 * esr[ch] > esr_limit_percent * esr0
+      || 100 * cap[ch] < cap_limit_percent * cap0;
+    if (worn && !h->cap_worn)
+      event_log(EVENT_CAPACITOR_WEAR, ch + 1);
+    h->cap_worn = worn;
+  }
+  return 0;
+}
+
+static void accumulate(bool current)
+{
+  int32_t *sum = current ? i_sum : v_sum;
+  uint16_t *count = current ? i_n : v_n;
+  uint32_t f = regulator_get_switching_frequency(measuring->reg);
+
+  for (unsigned int k=0; k<CAPTURE_LEN; k++) {
+    unsigned int bin = (uint32_t) k * f * PHASE_BINS / CAPTURE_RATE % PHASE_BINS;
+    sum[bin] += samples[k];
+    count[bin]++;
+  }
+}
+
+static void estimate(struct channel_health *h)
+{
+  uint32_t vgain, igain;
+  regulator_get_sense_gains(h->reg, &vgain, &igain);
+  float f = regulator_get_switching_frequency(h->reg);
+  float dt = 1 / (f * PHASE_BINS);
+
+  float v[PHASE_BINS], i[PHASE_BINS], q[PHASE_BINS];
+  float v_mean = 0, i_mean = 0;
+  for (unsigned int b=0; b<PHASE_BINS; b++) {
+    if (!v_n[b] || !i_n[b]) return;
+    v[b] = (float) v_sum[b] / v_n[b] / vgain;
+    i[b] = (float) i_sum[b] / i_n[b] / igain;
+    v_mean += v[b] / PHASE_BINS;
+    i_mean += i[b] / PHASE_BINS;
+  }
+
+  // ripple components, and the charge the current ripple moves
+  float i_min = 1e9f, i_max = -1e9f, charge = 0, q_mean = 0;
+  for (unsigned int b=0; b<PHASE_BINS; b++) {
+    v[b] -= v_mean;
+    i[b] -= i_mean;
+    if (i[b] < i_min) i_min = i[b];
+    if (i[b] > i_max) i_max = i[b];
+    charge += i[b] * dt;
+    q[b] = charge;
+    q_mean += charge / PHASE_BINS;
+  }
+  float ripple = i_max - i_min;
+  if (ripple < min_ripple_a) return;
+  h->ripple_ma = ripple * 1000;
+
+  // least squares fit of v = esr * i + q / c
+  float sii = 0, sqq = 0, siq = 0, svi = 0, svq = 0;
+  for (unsigned int b=0; b<PHASE_BINS; b++) {
+    q[b] -= q_mean;
+    sii += i[b] * i[b];
+    sqq += q[b] * q[b];
+    siq += i[b] * q[b];
+    svi += v[b] * i[b];
+    svq += v[b] * q[b];
+  }
+  float det = sii * sqq - siq * siq;
+  if (det > 0) {
+    float esr = (svi * sqq - svq * siq) / det;
+    float inv_c = (sii * svq - siq * svi) / det;
+    if (esr > 0 && esr < 65.535f && inv_c > 1 / 65535e-6f) {
+      h->esr_mohm = esr * 1000;
+      h->cap_uf = 1e6f / inv_c;
+      h->esr_sum += h->esr_mohm;
+      h->cap_sum += h->cap_uf;
+      h->day_count++;
+    }
+  }
+
+  // inductance from the off-time slope, L = (1 - d) Vout / (f dI)
+  float d = regulator_get_duty_cycle_1(h->reg) / 65536.0f;
+  float l = (1 - d) * regulator_get_vsense(h->reg) / 65536.0f / (f * ripple);
+  if (l <= 0 || l > 65535e-6f) return;
+  h->l_uh = l * 1e6f;
+
+  if (i_mean < low_current_a) {
+    // slow average of the unsaturated inductance
+    h->l_ref_uh = h->l_ref_uh ? h->l_ref_uh + ((int) h->l_uh - h->l_ref_uh) / 8 : h->l_uh;
+  } else if (h->l_ref_uh && 100 * h->l_uh < saturation_percent * h->l_ref_uh) {
+    uint16_t ma = i_mean * 1000;
+    if (!h->sat_onset_ma)
+      event_log(EVENT_INDUCTOR_SATURATION, ma);
+    if (!h->sat_onset_ma || ma < h->sat_onset_ma)
+      h->sat_onset_ma = ma;
+  }
+}
+
+static void start_measurement(void)
+{
+  for (unsigned int n=0; n<NUM_CHANNELS; n++) {
+    struct channel_health *h = &channels[next_channel];
+    next_channel = (next_channel + 1) % NUM_CHANNELS;
+    if (regulator_get_mode(h->reg) != DISABLED) {
+      measuring = h;
+      burst = 0;
+      for (unsigned int b=0; b<PHASE_BINS; b++) {
+        v_sum[b] = i_sum[b] = 0;
+        v_n[b] = i_n[b] = 0;
+      }
+      return;
+    }
+  }
+}
+
+void health_poll(void)
+{
+  // retried until the EEPROM queue has room for the whole entry
+  if (history_day_over(&history))
+    day_pending = true;
+  if (day_pending && !end_of_day())
+    day_pending = false;
+
+  if (capturing) {
+    if (capture_busy())
+      return;
+    capturing = false;
+    accumulate(burst >= BURSTS);
+    if (++burst == 2 * BURSTS) {
+      estimate(measuring);
+      measuring = NULL;
+    }
+    return;
+  }
+
+  if (!measuring) {
+    if (msTicks - last_measurement_ms < measurement_interval_ms)
+      return;
+    last_measurement_ms = msTicks;
+    start_measurement();
+    if (!measuring) return;
+  }
+
+  if (regulator_get_mode(measuring->reg) == DISABLED) {
+    measuring = NULL;
+    return;
+  }
+  if (regulator_start_ripple_capture(measuring->reg, burst >= BURSTS,
+                                     samples, CAPTURE_LEN) == 0)
+    capturing = true;
+}
+
+bool health_capacitor_worn(void)
+{
+  return channels[0].cap_worn || channels[1].cap_worn;
+}
+
+bool health_inductor_saturating(void)
+{
+  return channels[0].sat_onset_ma || channels[1].sat_onset_ma;
+}
+
+void health_report(void)
+{
+  print_value("days recorded = ", history_count(&history), "\n");
+  for (unsigned int ch=0; ch<NUM_CHANNELS; ch++) {
+    struct channel_health *h = &channels[ch];
+    print_value("channel ", ch + 1, "\n");
+    print_value("  esr = ", h->esr_mohm, " mOhm");
+    print_value(", baseline ", baseline_esr(ch), " mOhm\n");
+    print_value("  capacitance = ", h->cap_uf, " uF");
+    print_value(", baseline ", baseline_cap(ch), " uF\n");
+    print_value("  ripple = ", h->ripple_ma, " mA\n");
+    print_value("  inductance = ", h->l_uh, " uH");
+    print_value(", low current ", h->l_ref_uh, " uH\n");
+    if (h->sat_onset_ma)
+      print_value("  saturation from ", h->sat_onset_ma, " mA\n");
+    usart_print(h->cap_worn ? "  capacitor worn\n" : "");
+  }
+}
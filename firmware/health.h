@@ -0,0 +1,26 @@
+#include <stdbool.h>
+
+/*
+ * Output capacitor and inductor health
+ *
+ * Bursts of each active channel's voltage and current sense are captured
+ * in step with its PWM carrier and folded into one averaged switching
+ * period. The voltage ripple is fitted as ESR times the current ripple
+ * plus its integral over the capacitance, and the peak-to-peak current
+ * ripple gives the inductance at the present duty and voltage; a drop in
+ * inductance at high current marks the onset of core saturation. The
+ * model assumes the sensed current is the inductor current flowing into
+ * the sensed capacitor, as on a buck stage.
+ *
+ * Daily averages go to a history in data EEPROM and are compared with the
+ * first day on record: ESR doubling or capacitance falling by 20% is the
+ * usual end-of-life criterion for electrolytics.
+ */
+
+// capture and evaluate periodically, call from the main loop
+void health_poll(void);
+
+bool health_capacitor_worn(void);
+bool health_inductor_saturating(void);
+
+void health_report(void);
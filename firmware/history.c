@@ -0,0 +1,60 @@
+#include "history.h"
+#include "eeprom.h"
+#include "clock.h"
+
+static const uint32_t day_s = 24 * 3600;
+
+#define HDR_MAGIC(h) ((h)->offset + 0)
+#define HDR_HEAD(h)  ((h)->offset + 2)
+#define HDR_COUNT(h) ((h)->offset + 4)
+#define ENTRIES(h)   ((h)->offset + (h)->header_size)
+#define COMMIT_WRITES 3  // head, count and magic
+
+bool history_day_over(struct history *h)
+{
+  uint32_t now = monotonic_us() / 1000000;
+  if (now - h->day_start_s < day_s)
+    return false;
+  h->day_start_s = now;
+  return true;
+}
+
+unsigned int history_count(const struct history *h)
+{
+  if (eeprom_read_u16(HDR_MAGIC(h)) != h->magic) return 0;
+  unsigned int n = eeprom_read_u16(HDR_COUNT(h));
+  return n > h->days ? h->days : n;
+}
+
+uint32_t history_entry(const struct history *h, unsigned int age)
+{
+  unsigned int head = eeprom_read_u16(HDR_HEAD(h)) % h->days;
+  unsigned int i = (head + h->days - 1 - age) % h->days;
+  return ENTRIES(h) + h->entry_size * i;
+}
+
+bool history_has_room(const struct history *h, unsigned int writes)
+{
+  (void) h;
+  return eeprom_free() >= writes + COMMIT_WRITES;
+}
+
+uint32_t history_next(const struct history *h)
+{
+  unsigned int head = history_count(h) ? eeprom_read_u16(HDR_HEAD(h)) % h->days : 0;
+  return ENTRIES(h) + h->entry_size * head;
+}
+
+int history_commit(const struct history *h)
+{
+  unsigned int n = history_count(h);
+  unsigned int head = n ? eeprom_read_u16(HDR_HEAD(h)) % h->days : 0;
+  if (eeprom_free() < COMMIT_WRITES)
+    return -1;
+  int ret = eeprom_write_u16(HDR_HEAD(h), (head + 1) % h->days);
+  if (n < h->days)
+    ret |= eeprom_write_u16(HDR_COUNT(h), n + 1);
+  if (n == 0)
+    ret |= eeprom_write_u16(HDR_MAGIC(h), h->magic);
+  return ret;
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Daily history ring
+ *
+ * A ring of fixed-size daily entries in data EEPROM behind a header: the
+ * magic, head and count words, a spare word, then any words of the
+ * user's own up to header_size. A new day's entry is written at history_next and becomes
+ * part of the history at history_commit; the magic goes last on the first
+ * day, so a reset before then leaves the history empty.
+ */
+
+struct history {
+  uint32_t offset;       // of the header
+  uint16_t magic;
+  uint16_t days;         // ring length
+  uint8_t entry_size;    // bytes, a multiple of 2
+  uint8_t header_size;   // bytes from the header to the ring, at least 8
+  uint32_t day_start_s;  // uptime the current day started at
+};
+
+// whether a day has passed since the last call that returned true
+bool history_day_over(struct history *h);
+
+unsigned int history_count(const struct history *h);
+// EEPROM offset of an entry, age 0 is the most recent day
+uint32_t history_entry(const struct history *h, unsigned int age);
+
+// whether the EEPROM queue holds an entry of the given writes and its
+// commit, check it before writing the entry
+bool history_has_room(const struct history *h, unsigned int writes);
+
+// EEPROM offset to write a new day's entry at, then commit it
+uint32_t history_next(const struct history *h);
+// returns 0 if the commit was queued, -1 if the queue overflowed
+int history_commit(const struct history *h);
@@ -0,0 +1,178 @@
+#include <libopencm3/stm32/i2c.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/nvic.h>
+
+#include "i2c_bus.h"
+#include "config.h"
+#include "power.h"
+#include "clock.h"
+
+#include <stddef.h>
+
+static const uint32_t timeout_ms = 10;
+
+static struct i2c_transaction *head, *tail; // head is on the bus
+static unsigned int pos;  // bytes done in the current phase
+static bool reading;      // phase of the transaction on the bus
+static uint32_t started_ms;
+static bool in_done;      // complete() starts whatever done submits
+
+/*
+ * The queue is shared with the I2C interrupts only, so mask those rather
+ * than all interrupts; this also works from a done callback and leaves a
+ * caller's own masking alone.
+ */
+static void lock(void)
+{
+  nvic_disable_irq(NVIC_I2C1_EV_IRQ);
+  nvic_disable_irq(NVIC_I2C1_ER_IRQ);
+}
+
+static void unlock(void)
+{
+  nvic_enable_irq(NVIC_I2C1_EV_IRQ);
+  nvic_enable_irq(NVIC_I2C1_ER_IRQ);
+}
+
+static void setup(void)
+{
+  i2c_reset(I2C1);
+  // setup clocking: change when clocking is changed
+  i2c_set_clock_frequency(I2C1, 16);
+  i2c_set_ccr(I2C1, 0x40);
+  i2c_set_standard_mode(I2C1);
+  i2c_enable_interrupt(I2C1, I2C_CR2_ITEVTEN | I2C_CR2_ITERREN);
+  i2c_peripheral_enable(I2C1);
+}
+
+static void start(struct i2c_transaction *t)
+{
+  pos = 0;
+  reading = t->write_len == 0;
+  started_ms = msTicks;
+  i2c_nack_current(I2C1);
+  i2c_send_start(I2C1);
+}
+
+// finish the transaction on the bus and start the next
+static void complete(enum i2c_status status)
+{
+  struct i2c_transaction *t = head;
+  i2c_disable_interrupt(I2C1, I2C_CR2_ITBUFEN);
+  head = t->next;
+  if (!head) tail = NULL;
+  t->status = status;
+  if (t->done) {
+    in_done = true;
+    t->done(t);
+    in_done = false;
+  }
+  if (head) {
+    start(head);
+  } else {
+    i2c_peripheral_disable(I2C1);
+    power_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_I2C1EN);
+  }
+}
+
+int i2c_bus_submit(struct i2c_transaction *t)
+{
+  if (t->status == I2C_PENDING)
+    return -1;
+  t->status = I2C_PENDING;
+  t->next = NULL;
+
+  lock();
+  if (tail) {
+    tail->next = t;
+    tail = t;
+  } else {
+    head = tail = t;
+    if (!in_done) {
+      power_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_I2C1EN);
+      setup();
+      start(t);
+    }
+  }
+  unlock();
+  return 0;
+}
+
+void i2c_bus_poll(void)
+{
+  lock();
+  if (head && msTicks - started_ms > timeout_ms) {
+    setup();
+    complete(I2C_TIMEOUT);
+  }
+  unlock();
+}
+
+void i2c1_ev_isr(void)
+{
+  struct i2c_transaction *t = head;
+  uint32_t sr1 = I2C_SR1(I2C1);
+  if (!t) return;
+
+  if (sr1 & I2C_SR1_SB) {
+    i2c_send_7bit_address(I2C1, t->address, reading ? I2C_READ : I2C_WRITE);
+  } else if (sr1 & I2C_SR1_ADDR) {
+    if (reading && t->read_len == 1) {
+      // NACK the only byte, and stop once it is in
+      i2c_disable_ack(I2C1);
+      (void) I2C_SR2(I2C1);
+      i2c_send_stop(I2C1);
+    } else if (reading && t->read_len == 2) {
+      // two bytes: POS moves the NACK to the second, and both are taken
+      // at BTF, with the clock stretched, rather than byte by byte
+      i2c_disable_ack(I2C1);
+      i2c_nack_next(I2C1);
+      (void) I2C_SR2(I2C1);
+      return;
+    } else {
+      if (reading) i2c_enable_ack(I2C1);
+      (void) I2C_SR2(I2C1);
+    }
+    i2c_enable_interrupt(I2C1, I2C_CR2_ITBUFEN);
+  } else if (!reading && (sr1 & (I2C_SR1_TxE | I2C_SR1_BTF))) {
+    if (pos < t->write_len) {
+      i2c_send_data(I2C1, t->write[pos++]);
+    } else if (!(sr1 & I2C_SR1_BTF)) {
+      // last byte is shifting out, wait for BTF alone
+      i2c_disable_interrupt(I2C1, I2C_CR2_ITBUFEN);
+    } else if (t->read_len) {
+      reading = true;
+      pos = 0;
+      i2c_disable_interrupt(I2C1, I2C_CR2_ITBUFEN);
+      i2c_send_start(I2C1);
+    } else {
+      i2c_send_stop(I2C1);
+      complete(I2C_OK);
+    }
+  } else if (reading && t->read_len == 2) {
+    if (sr1 & I2C_SR1_BTF) {
+      i2c_send_stop(I2C1);
+      t->read[0] = i2c_get_data(I2C1);
+      t->read[1] = i2c_get_data(I2C1);
+      complete(I2C_OK);
+    }
+  } else if (reading && (sr1 & I2C_SR1_RxNE)) {
+    t->read[pos++] = i2c_get_data(I2C1);
+    if (pos == t->read_len) {
+      complete(I2C_OK);
+    } else if (pos == t->read_len - 1u) {
+      // NACK the byte now being received, the last
+      i2c_disable_ack(I2C1);
+      i2c_send_stop(I2C1);
+    }
+  }
+}
+
+void i2c1_er_isr(void)
+{
+  uint32_t sr1 = I2C_SR1(I2C1);
+  I2C_SR1(I2C1) = sr1 & ~(I2C_SR1_AF | I2C_SR1_ARLO | I2C_SR1_BERR);
+  if (!head) return;
+  i2c_send_stop(I2C1);
+  complete(sr1 & I2C_SR1_AF ? I2C_NACK : I2C_ERROR);
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * I2C1 transaction queue
+ *
+ * Transactions are queued by their owners and run one after another from
+ * the I2C interrupts, so no caller waits on the bus. A transaction writes
+ * write_len bytes, then reads read_len bytes after a repeated start; either
+ * may be zero. The owner keeps the transaction and its buffers until the
+ * status leaves I2C_PENDING; done, if set, is called from interrupt
+ * context on completion and may submit again. The peripheral is clocked
+ * only while the queue is not empty.
+ */
+
+enum i2c_status { I2C_IDLE, I2C_PENDING, I2C_OK, I2C_NACK, I2C_ERROR, I2C_TIMEOUT };
+
+struct i2c_transaction {
+  uint8_t address;
+  uint8_t write_len, read_len;
+  const uint8_t *write;
+  uint8_t *read;
+  void (*done)(struct i2c_transaction *t);
+  volatile enum i2c_status status;
+  struct i2c_transaction *next;
+};
+
+// returns 0 if queued, -1 if the transaction is already pending
+int i2c_bus_submit(struct i2c_transaction *t);
+
+// recover a stuck bus, call periodically from the main loop
+void i2c_bus_poll(void);
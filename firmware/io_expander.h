@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdbool.h>
 
 enum led_state {
   led_off        = 0x0,
@@ -12,3 +13,5 @@ enum led_state {
 
 void clear_leds(void);
 void set_led(uint8_t led, enum led_state state);
+// whether an LED frame is still on the I2C bus
+bool leds_pending(void);
@@ -0,0 +1,372 @@
+#include "jobs.h"
+#include "regulator.h"
+#include "lighting.h"
+#include "kv.h"
+#include "clock.h"
+#include "usart.h"
+#include "pool.h"
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RESULT_LEN 40
+
+// the console holds a block of its own, so a free one may not come soon
+static const uint32_t ack_wait_ms = 100;
+
+enum job_status { JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED };
+
+struct job_type {
+  const char *name;
+  int (*start)(const char *args, const char **reason);
+  enum job_status (*step)(char *result, uint8_t *progress);
+  void (*cancel)(void);
+};
+
+enum job_state { JOB_FREE, JOB_ACTIVE, JOB_CANCELLING, JOB_FINISHED };
+
+struct job {
+  enum job_state state;
+  uint16_t id;
+  const struct job_type *type;
+  uint8_t progress, reported;  // percent
+  enum job_status status;
+  char result[RESULT_LEN];
+};
+
+static struct job jobs[JOBS_MAX];
+
+// decimal without padding, returns end of string
+static char *utoa(char *str, unsigned int val)
+{
+  unsigned int len = 1;
+  for (unsigned int v=val; v >= 10; v /= 10)
+    len++;
+  return itoa(str, len, val);
+}
+
+/*******************************
+ * I-V sweep
+ *******************************/
+#define SWEEP_STEPS 64
+static const uint32_t sweep_settle_ms = 20;
+
+/*
+ * Channel 1 only: it sits between the panel, which bounds the current, and
+ * the battery. Channel 2 at full duty would put the battery across its
+ * load. The sweep takes the channel only from nobody, i.e. disabled or at
+ * a manual duty, and gives up if anyone else takes it meanwhile.
+ */
+static struct {
+  struct regulator_t *reg;
+  enum feedback_mode old_mode;
+  fract32_t old_d1, old_d2;
+  unsigned int step;
+  uint32_t t;
+  int64_t best_p;
+  fixed32_t best_v;
+} sweep;
+
+static void sweep_restore(void)
+{
+  if (regulator_get_mode(sweep.reg) != CONST_DUTY)
+    return;
+  regulator_set_mode(sweep.reg, DISABLED);
+  regulator_set_duty_cycle(sweep.reg, sweep.old_d1, sweep.old_d2);
+  regulator_set_mode(sweep.reg, sweep.old_mode);
+}
+
+static int sweep_start(const char *args, const char **reason)
+{
+  if (args[0] && args[0] != '1') {
+    *reason = "channel 1 only";
+    return -1;
+  }
+#if CONFIG_LIGHTING
+  // lighting senses dusk and dawn on channel 1
+  if (lighting_get_state() != LIGHTING_OFF) {
+    *reason = "lighting active";
+    return -1;
+  }
+#endif
+  sweep.reg = &chan1;
+  sweep.old_mode = regulator_get_mode(sweep.reg);
+  if (sweep.old_mode != DISABLED && sweep.old_mode != CONST_DUTY) {
+    *reason = "channel in use";
+    return -1;
+  }
+  sweep.old_d1 = regulator_get_duty_cycle_1(sweep.reg);
+  sweep.old_d2 = regulator_get_duty_cycle_2(sweep.reg);
+  sweep.step = 0;
+  sweep.best_p = 0;
+  sweep.best_v = 0;
+
+  regulator_set_mode(sweep.reg, DISABLED);
+  regulator_set_duty_cycle(sweep.reg, 0, 0);
+  if (regulator_set_mode(sweep.reg, CONST_DUTY)) {
+    sweep_restore();
+    *reason = "channel unavailable";
+    return -1;
+  }
+  sweep.t = msTicks;
+  return 0;
+}
+
+static enum job_status sweep_step(char *result, uint8_t *progress)
+{
+  if (regulator_get_mode(sweep.reg) != CONST_DUTY) {
+    strcpy(result, "channel taken");
+    return JOB_FAILED;
+  }
+  if (regulator_get_isense(sweep.reg) > regulator_get_ilimit(sweep.reg)) {
+    sweep_restore();
+    strcpy(result, "over current limit");
+    return JOB_FAILED;
+  }
+  if (msTicks - sweep.t < sweep_settle_ms)
+    return JOB_RUNNING;
+
+  fixed32_t v = regulator_get_vsense(sweep.reg);
+  int64_t p = (int64_t) v * regulator_get_isense(sweep.reg);
+  if (p > sweep.best_p) {
+    sweep.best_p = p;
+    sweep.best_v = v;
+  }
+
+  if (++sweep.step > SWEEP_STEPS) {
+    sweep_restore();
+    char *end = result;
+    strcpy(end, "pmax=");
+    end = utoa(end + strlen(end), (sweep.best_p * 1000) >> 32);
+    strcpy(end, " mW at ");
+    end = utoa(end + strlen(end), ((int64_t) sweep.best_v * 1000) >> 16);
+    strcpy(end, " mV");
+    return JOB_DONE;
+  }
+
+  regulator_set_duty_cycle(sweep.reg, 0xffff * sweep.step / SWEEP_STEPS, 0);
+  sweep.t = msTicks;
+  *progress = 100 * sweep.step / (SWEEP_STEPS + 1);
+  return JOB_RUNNING;
+}
+
+/*******************************
+ * Self-test
+ *******************************/
+static int selftest_start(const char *args, const char **reason)
+{
+  (void) args;
+  if (regulator_get_mode(&chan1) != DISABLED || regulator_get_mode(&chan2) != DISABLED) {
+    *reason = "disable both channels first";
+    return -1;
+  }
+  return 0;
+}
+
+static enum job_status selftest_step(char *result, uint8_t *progress)
+{
+  (void) progress;
+  int failures = regulator_self_test();
+  strcpy(result, "failures=");
+  utoa(result + strlen(result), failures < 0 ? 0xffff : failures);
+  return failures ? JOB_FAILED : JOB_DONE;
+}
+
+#if CONFIG_KV
+/*******************************
+ * Key-value store write-back
+ *******************************/
+static int kvsync_start(const char *args, const char **reason)
+{
+  (void) args;
+  (void) reason;
+  return 0;
+}
+
+// the write-back itself runs from kv_poll, in gaps of the control loop
+static enum job_status kvsync_step(char *result, uint8_t *progress)
+{
+  (void) progress;
+  if (kv_pending())
+    return JOB_RUNNING;
+  strcpy(result, "ok");
+  return JOB_DONE;
+}
+#endif
+
+static const struct job_type types[] = {
+  { "iv",       sweep_start,    sweep_step,    sweep_restore },
+  { "selftest", selftest_start, selftest_step, NULL },
+#if CONFIG_KV
+  { "kvsync",   kvsync_start,   kvsync_step,   NULL },
+#endif
+};
+
+/*******************************
+ * Scheduling
+ *******************************/
+static struct job *find(uint16_t id)
+{
+  for (unsigned int i=0; i<JOBS_MAX; i++)
+    if (jobs[i].state != JOB_FREE && jobs[i].id == id)
+      return &jobs[i];
+  return NULL;
+}
+
+// copy src to dst, stopping before limit, returns end of copy
+static char *append(char *dst, const char *limit, const char *src)
+{
+  while (*src && dst < limit)
+    *dst++ = *src++;
+  return dst;
+}
+
+// returns 0 if the message was queued
+static int send(uint16_t id, const char *msg, const char *detail)
+{
+  struct pool_block *b = pool_alloc();
+  if (!b) return -1;
+
+  const char *limit = b->data + POOL_BLOCK_SIZE - 1; // room for the newline
+  char *end = b->data;
+  *end++ = '@';
+  end = utoa(end, id);
+  end = append(end, limit, " ");
+  end = append(end, limit, msg);
+  if (detail) {
+    end = append(end, limit, " ");
+    end = append(end, limit, detail);
+  }
+  *end++ = '\n';
+  b->len = end - b->data;
+  usart_send_block(b);
+  return 0;
+}
+
+int jobs_submit(uint16_t id, const char *name, const char *args, const char **reason)
+{
+  const struct job_type *type = NULL;
+  for (unsigned int t=0; t<sizeof(types) / sizeof(types[0]); t++)
+    if (strcmp(types[t].name, name) == 0)
+      type = &types[t];
+  if (!type) {
+    *reason = "unknown job";
+    return -1;
+  }
+  if (find(id)) {
+    *reason = "id in use";
+    return -1;
+  }
+
+  struct job *j = NULL;
+  for (unsigned int i=0; i<JOBS_MAX; i++) {
+    if (jobs[i].state != JOB_FREE && jobs[i].type == type) {
+      *reason = "busy";
+      return -1;
+    }
+    if (jobs[i].state == JOB_FREE && !j)
+      j = &jobs[i];
+  }
+  if (!j) {
+    *reason = "too many jobs";
+    return -1;
+  }
+
+  if (type->start(args, reason))
+    return -1;
+  j->id = id;
+  j->type = type;
+  j->progress = j->reported = 0;
+  j->result[0] = '\0';
+  j->state = JOB_ACTIVE;
+  return 0;
+}
+
+int jobs_cancel(uint16_t id)
+{
+  struct job *j = find(id);
+  if (!j || j->state != JOB_ACTIVE)
+    return -1;
+  j->state = JOB_CANCELLING;
+  return 0;
+}
+
+void jobs_poll(void)
+{
+  static const unsigned int progress_step = 10; // percent between reports
+
+  for (unsigned int i=0; i<JOBS_MAX; i++) {
+    struct job *j = &jobs[i];
+
+    if (j->state == JOB_CANCELLING) {
+      if (j->type->cancel)
+        j->type->cancel();
+      j->status = JOB_CANCELLED;
+      j->state = JOB_FINISHED;
+    } else if (j->state == JOB_ACTIVE) {
+      j->status = j->type->step(j->result, &j->progress);
+      if (j->status != JOB_RUNNING) {
+        j->state = JOB_FINISHED;
+      } else if (j->progress >= j->reported + progress_step) {
+        char pct[5];
+        strcpy(utoa(pct, j->progress), "%");
+        if (send(j->id, pct, NULL) == 0)
+          j->reported = j->progress;
+      }
+    }
+
+    // completions are retried until the pool has room for them
+    if (j->state == JOB_FINISHED) {
+      int ret;
+      if (j->status == JOB_CANCELLED)
+        ret = send(j->id, "cancelled", NULL);
+      else
+        ret = send(j->id, j->status == JOB_DONE ? "done" : "failed", j->result);
+      if (ret == 0)
+        j->state = JOB_FREE;
+    }
+  }
+}
+
+void jobs_request(const char *line)
+{
+  char name[12];
+  char *end;
+  uint16_t id = strtol(line, &end, 10);
+  while (*end == ' ') end++;
+
+  unsigned int n = 0;
+  while (*end != ' ' && *end != '\0' && n < sizeof(name) - 1)
+    name[n++] = *end++;
+  name[n] = '\0';
+  while (*end == ' ') end++;
+
+  const char *reason = "no such job";
+  int ret = strcmp(name, "cancel") == 0
+    ? jobs_cancel(id) : jobs_submit(id, name, end, &reason);
+  // the acknowledgement goes through the same queue as the job's messages,
+  // it is dropped if no block frees up in time
+  uint32_t wait_start = msTicks;
+  while (send(id, ret ? "nak" : "ack", ret ? reason : NULL)
+         && msTicks - wait_start < ack_wait_ms);
+}
+
+void jobs_report(void)
+{
+  char buf[12];
+  for (unsigned int i=0; i<JOBS_MAX; i++) {
+    struct job *j = &jobs[i];
+    if (j->state == JOB_FREE) continue;
+    usart_print("@");
+    utoa(buf, j->id);
+    usart_print(buf);
+    usart_print(" ");
+    usart_print(j->type->name);
+    usart_print(" ");
+    strcpy(utoa(buf, j->progress), "%\n");
+    usart_print(buf);
+  }
+}
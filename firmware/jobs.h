@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+/*
+ * Background jobs
+ *
+ * Long operations run as jobs stepped from the main loop, so the console
+ * stays responsive and several requests can be in flight on one link.
+ * A request "@ID NAME ARGS" is answered at once with "@ID ack" or
+ * "@ID nak REASON"; the job then reports "@ID NN%" as it progresses and
+ * finishes with "@ID done RESULT", "@ID failed RESULT" or
+ * "@ID cancelled", in whatever order jobs complete. Only one job of each
+ * kind runs at a time, as they share hardware.
+ */
+
+#define JOBS_MAX 4
+
+// handle a request line, without its leading '@'
+void jobs_request(const char *line);
+
+// returns 0 if the job was started, otherwise a reason is written to reason
+int jobs_submit(uint16_t id, const char *name, const char *args, const char **reason);
+// returns 0 if the job was running
+int jobs_cancel(uint16_t id);
+
+// step running jobs and send their messages, call from the main loop
+void jobs_poll(void);
+
+void jobs_report(void);
@@ -0,0 +1,310 @@
+#include "kv.h"
+#include "eeprom.h"
+#include "usart.h"
+
+#include <string.h>
+
+/*
+ * Bank layout: a header word holding the magic and the bank's sequence
+ * number, a word with their CRC, then records. A record is a header word
+ * (key, length, CRC) followed by the value padded to whole words. The
+ * record CRC covers the bank sequence number, so records left over from
+ * an older use of the bank never validate. The value is written before
+ * its header, and the erased header (0) of the next record ends the log.
+ */
+#define BANK_SIZE 0x500
+#define BANK(n) (EEPROM_KV_OFFSET + (n) * BANK_SIZE)
+#define BANK_DATA 8
+#define KV_MAGIC 0x4b56
+#define CACHE_ENTRIES 8
+
+struct cache_entry {
+  uint8_t key, len;
+  bool dirty;
+  uint8_t data[KV_MAX_VALUE];
+};
+
+static unsigned int bank;
+static uint16_t seq;
+static uint32_t end;                  // append position within the bank
+static uint16_t records[KV_MAX_KEYS]; // latest record per key, 0 if none
+static struct cache_entry cache[CACHE_ENTRIES];
+
+// write-back state
+enum flush_state { FLUSH_IDLE, FLUSH_APPEND, FLUSH_COMPACT, FLUSH_COMPACT_HEADER };
+static enum flush_state state;
+static struct cache_entry *flushing;
+static unsigned int word;             // next word of the current record
+static unsigned int compact_key;
+static uint32_t compact_end;
+static unsigned int compactions;
+
+static unsigned int padded(unsigned int len)
+{
+  return (len + 3) & ~3;
+}
+
+static uint16_t record_crc(uint16_t s, uint8_t key, uint8_t len, const void *data)
+{
+  uint8_t hdr[4] = { s, s >> 8, key, len };
+  return crc16(crc16(0xffff, hdr, 4), data, len);
+}
+
+static uint32_t record_header(uint16_t s, uint8_t key, uint8_t len, const void *data)
+{
+  return key | (len << 8) | ((uint32_t) record_crc(s, key, len, data) << 16);
+}
+
+static void read_value(uint32_t offset, void *buf, unsigned int len)
+{
+  uint8_t *p = buf;
+  for (unsigned int i=0; i<len; i++)
+    p[i] = eeprom_read_u8(offset + i);
+}
+
+// a word of value data, zero padded
+static uint32_t value_word(const uint8_t *data, unsigned int len, unsigned int w)
+{
+  uint32_t v = 0;
+  for (unsigned int i=0; i<4 && 4*w + i < len; i++)
+    v |= (uint32_t) data[4*w + i] << (8*i);
+  return v;
+}
+
+static bool bank_valid(unsigned int n, uint16_t *s)
+{
+  uint32_t w0 = eeprom_read_u32(BANK(n));
+  uint32_t w1 = eeprom_read_u32(BANK(n) + 4);
+  if ((w0 & 0xffff) != KV_MAGIC || w1 != crc16(0xffff, &w0, 4))
+    return false;
+  *s = w0 >> 16;
+  return true;
+}
+
+static void scan(void)
+{
+  uint8_t data[KV_MAX_VALUE];
+  for (unsigned int k=0; k<KV_MAX_KEYS; k++)
+    records[k] = 0;
+
+  uint32_t pos = BANK_DATA;
+  while (pos + 4 <= BANK_SIZE) {
+    uint32_t hdr = eeprom_read_u32(BANK(bank) + pos);
+    uint8_t key = hdr, len = hdr >> 8;
+    if (hdr == 0 || len > KV_MAX_VALUE || pos + 4 + padded(len) > BANK_SIZE)
+      break;
+    read_value(BANK(bank) + pos + 4, data, len);
+    if (hdr >> 16 != record_crc(seq, key, len, data))
+      break;
+    if (key < KV_MAX_KEYS)
+      records[key] = pos;
+    pos += 4 + padded(len);
+  }
+  end = pos;
+}
+
+static void write_bank_header(unsigned int n, uint16_t s)
+{
+  // the CRC word first, so a reset in between leaves the bank invalid
+  uint32_t w0 = KV_MAGIC | ((uint32_t) s << 16);
+  eeprom_write_u32(BANK(n) + 4, crc16(0xffff, &w0, 4));
+  eeprom_write_u32(BANK(n), w0);
+}
+
+void kv_init(void)
+{
+  uint16_t s0, s1;
+  bool v0 = bank_valid(0, &s0), v1 = bank_valid(1, &s1);
+
+  if (v0 && v1) {
+    bank = (int16_t) (s1 - s0) > 0;
+    seq = bank ? s1 : s0;
+  } else if (v0 || v1) {
+    bank = v1;
+    seq = v1 ? s1 : s0;
+  } else {
+    bank = 0;
+    seq = 1;
+    write_bank_header(0, seq);
+  }
+  scan();
+}
+
+static struct cache_entry *cache_find(uint8_t key)
+{
+  for (unsigned int i=0; i<CACHE_ENTRIES; i++)
+    if (cache[i].key == key)
+      return &cache[i];
+  return NULL;
+}
+
+int kv_get(enum kv_key key, void *buf, unsigned int len)
+{
+  if (key == 0 || key >= KV_MAX_KEYS)
+    return -1;
+
+  struct cache_entry *e = cache_find(key);
+  if (e) {
+    memcpy(buf, e->data, len < e->len ? len : e->len);
+    return e->len;
+  }
+  if (!records[key])
+    return -1;
+  uint32_t offset = BANK(bank) + records[key];
+  unsigned int n = eeprom_read_u8(offset + 1);
+  read_value(offset + 4, buf, len < n ? len : n);
+  return n;
+}
+
+int kv_set(enum kv_key key, const void *buf, unsigned int len)
+{
+  if (key == 0 || key >= KV_MAX_KEYS || len > KV_MAX_VALUE)
+    return -1;
+
+  struct cache_entry *e = cache_find(key);
+  if (!e) {
+    // reuse a free or clean entry
+    for (unsigned int i=0; i<CACHE_ENTRIES && !e; i++)
+      if (!cache[i].dirty && &cache[i] != flushing)
+        e = &cache[i];
+    if (!e) return -1;
+  } else if (e->len == len && memcmp(e->data, buf, len) == 0) {
+    return 0;
+  } else if (e == flushing) {
+    // restart the record so a half-written value is never committed
+    word = 0;
+  }
+
+  e->key = key;
+  e->len = len;
+  memcpy(e->data, buf, len);
+  e->dirty = true;
+  return 0;
+}
+
+static struct cache_entry *next_dirty(void)
+{
+  for (unsigned int i=0; i<CACHE_ENTRIES; i++)
+    if (cache[i].dirty)
+      return &cache[i];
+  return NULL;
+}
+
+static void start_compaction(void)
+{
+  state = FLUSH_COMPACT;
+  compact_key = 1;
+  compact_end = BANK_DATA;
+  word = 0;
+}
+
+// one word of copying the live records to the other bank
+static void compact_step(void)
+{
+  unsigned int other = !bank;
+  uint16_t new_seq = seq + 1;
+
+  while (compact_key < KV_MAX_KEYS && !records[compact_key])
+    compact_key++;
+
+  if (compact_key == KV_MAX_KEYS) {
+    if (state == FLUSH_COMPACT) {
+      // terminate the log, then switch banks
+      if (compact_end + 4 <= BANK_SIZE)
+        eeprom_write_u32(BANK(other) + compact_end, 0);
+      state = FLUSH_COMPACT_HEADER;
+      return;
+    }
+    write_bank_header(other, new_seq);
+    bank = other;
+    seq = new_seq;
+    compactions++;
+    scan();
+    state = FLUSH_IDLE;
+    return;
+  }
+
+  uint8_t data[KV_MAX_VALUE];
+  uint32_t src = BANK(bank) + records[compact_key];
+  uint8_t len = eeprom_read_u8(src + 1);
+  read_value(src + 4, data, len);
+
+  if (word < padded(len) / 4) {
+    eeprom_write_u32(BANK(other) + compact_end + 4 + 4*word, value_word(data, len, word));
+    word++;
+  } else {
+    eeprom_write_u32(BANK(other) + compact_end, record_header(new_seq, compact_key, len, data));
+    compact_end += 4 + padded(len);
+    compact_key++;
+    word = 0;
+  }
+}
+
+// one word of appending the cached value being flushed
+static void append_step(void)
+{
+  struct cache_entry *e = flushing;
+  if (word < padded(e->len) / 4) {
+    eeprom_write_u32(BANK(bank) + end + 4 + 4*word, value_word(e->data, e->len, word));
+    word++;
+    return;
+  }
+
+  eeprom_write_u32(BANK(bank) + end, record_header(seq, e->key, e->len, e->data));
+  records[e->key] = end;
+  end += 4 + padded(e->len);
+  e->dirty = false;
+  flushing = NULL;
+  state = FLUSH_IDLE;
+}
+
+static void flush_step(void)
+{
+  if (state == FLUSH_IDLE) {
+    flushing = next_dirty();
+    if (!flushing) return;
+    if (end + 4 + padded(flushing->len) > BANK_SIZE) {
+      // the cached value is appended after compaction
+      flushing = NULL;
+      start_compaction();
+    } else {
+      state = FLUSH_APPEND;
+      word = 0;
+    }
+  }
+
+  if (state == FLUSH_APPEND)
+    append_step();
+  else
+    compact_step();
+}
+
+// one word per write queued before the next, so the store never fills
+// the EEPROM queue and records go out in order
+void kv_poll(void)
+{
+  if (eeprom_pending())
+    return;
+  if (state == FLUSH_IDLE && !next_dirty())
+    return;
+  flush_step();
+}
+
+bool kv_pending(void)
+{
+  return state != FLUSH_IDLE || next_dirty() || eeprom_pending();
+}
+
+void kv_report(void)
+{
+  unsigned int dirty = 0;
+  for (unsigned int i=0; i<CACHE_ENTRIES; i++)
+    dirty += cache[i].dirty;
+
+  print_value("bank = ", bank, "\n");
+  print_value("sequence = ", seq, "\n");
+  print_value("used = ", end, " bytes of ");
+  print_value("", BANK_SIZE, "\n");
+  print_value("compactions = ", compactions, "\n");
+  print_value("pending = ", dirty, "\n");
+}
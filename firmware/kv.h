@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Key-value store
+ *
+ * A log-structured store in two banks of data EEPROM. Each write appends a
+ * CRC'd record to the active bank; the latest record for a key wins. When
+ * the bank fills, the live records are copied to the other bank, which
+ * only takes over once its header is written, so a reset at any point
+ * leaves one consistent bank. Alternating banks spreads the wear.
+ *
+ * Values are written back from a RAM cache by kv_poll, one word at a time
+ * through the EEPROM write queue, so only in gaps between control loop
+ * samples (see eeprom.h).
+ */
+
+enum kv_key {
+  KV_ENERGY_CH1 = 1,  // lifetime harvested energy, J
+  KV_ENERGY_CH2,
+  KV_ARC_BASELINE,    // learned arc-fault band levels
+  KV_POINT_CH1,       // operating point checkpoint, see regulator.h
+  KV_POINT_CH2,
+  KV_MAX_KEYS
+};
+
+#define KV_MAX_VALUE 48
+
+// mount the store, formatting it if neither bank is valid
+void kv_init(void);
+
+// returns the value's length, or -1 if the key has no value
+int kv_get(enum kv_key key, void *buf, unsigned int len);
+// returns 0 if the value was cached for writing
+int kv_set(enum kv_key key, const void *buf, unsigned int len);
+
+// write back cached values, call periodically from the main loop
+void kv_poll(void);
+// whether anything is still to reach the EEPROM
+bool kv_pending(void);
+
+void kv_report(void);
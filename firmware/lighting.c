@@ -0,0 +1,235 @@
+#include "lighting.h"
+#include "regulator.h"
+#include "clock.h"
+
+/*
+ * Channel 1's voltage sense sits on the panel side, which doubles as the
+ * light sensor. Its divider is only powered, and the ADC only runs, while
+ * channel 1 is enabled, so lighting needs channel 1 running (normally
+ * tracking the panel) and stops if it is disabled. There is no battery
+ * voltage sense, so the battery's charge is estimated by counting energy
+ * in from channel 1 and out to channel 2.
+ */
+static struct regulator_t *const panel = &chan1;
+static struct regulator_t *const led = &chan2;
+
+static const uint32_t dusk_mv = 5000, dawn_mv = 7000;
+static const uint32_t debounce_s = 300;
+static const uint32_t poll_interval_ms = 1000;
+
+/* Dimming curve, in minutes after dusk; the pre-dawn level applies for
+ * the last predawn_min minutes before the expected dawn. */
+struct dimming_point {
+  uint16_t minutes;
+  uint8_t level; // percent
+};
+
+static const struct dimming_point curve[] = {
+  {   0, 100 },  // evening
+  { 240,  50 },  // midnight dip
+};
+static const uint16_t predawn_min = 120;
+static const uint8_t predawn_level = 80;
+static const uint8_t min_level = 10;
+static const unsigned int reserve_percent = 20; // never plan below this charge
+
+static enum lighting_state state = LIGHTING_OFF;
+static uint32_t rated_ma;
+static uint32_t capacity_j;
+static int64_t charge_j;
+static uint32_t last_in_j, last_out_j;
+
+static uint32_t last_poll_ms;
+static uint32_t transition_since_s; // panel past threshold since
+static bool transition_pending;
+static uint32_t dusk_s;
+static uint32_t night_length_s = 12 * 3600; // learned from the last night
+static unsigned int level;
+
+static uint32_t now_s(void)
+{
+  return monotonic_us() / 1000000;
+}
+
+static uint32_t panel_mv(void)
+{
+  return ((int64_t) regulator_get_vsense(panel) * 1000) >> 16;
+}
+
+// returns nonzero if channel 2 refused the level
+static int set_level(unsigned int percent)
+{
+  percent = (percent + 2) / 5 * 5;
+  if (percent > 100) percent = 100;
+  if (percent == level) return 0;
+  level = percent;
+
+  if (level == 0)
+    return regulator_set_mode(led, DISABLED);
+  // setpoints are 16.16 amps
+  if (regulator_set_isetpoint(led, ((uint64_t) rated_ma * level << 16) / 100000)
+      || (regulator_get_mode(led) != CURRENT_FB && regulator_set_mode(led, CURRENT_FB))) {
+    // e.g. channel 2 failed its self-test
+    level = 0;
+    regulator_set_mode(led, DISABLED);
+    return -1;
+  }
+  return 0;
+}
+
+// charge after energy in and out, kept within the battery
+static int64_t account(int64_t charge, uint32_t in_j, uint32_t out_j)
+{
+  charge += (int64_t) in_j - out_j;
+  if (charge > capacity_j) charge = capacity_j;
+  if (charge < 0) charge = 0;
+  return charge;
+}
+
+static void update_charge(void)
+{
+  uint32_t in = regulator_get_energy(panel), out = regulator_get_energy(led);
+  charge_j = account(charge_j, in - last_in_j, out - last_out_j);
+  last_in_j = in;
+  last_out_j = out;
+}
+
+static unsigned int scheduled_level(uint32_t since_dusk_s)
+{
+  uint32_t minutes = since_dusk_s / 60;
+  if (night_length_s > since_dusk_s && (night_length_s - since_dusk_s) / 60 < predawn_min)
+    return predawn_level;
+
+  unsigned int l = curve[0].level;
+  for (unsigned int i=0; i<sizeof(curve)/sizeof(curve[0]); i++)
+    if (minutes >= curve[i].minutes)
+      l = curve[i].level;
+  return l;
+}
+
+/* Scale the scheduled level so that the rest of the night fits in the
+ * charge above the reserve, assuming LED power is proportional to level. */
+static unsigned int autonomy_level(unsigned int scheduled, uint32_t since_dusk_s)
+{
+  if (level == 0 || since_dusk_s >= night_length_s)
+    return scheduled;
+
+  // present LED power, normalized to 100%
+  int64_t w = ((int64_t) regulator_get_vsense(led) * regulator_get_isense(led)) >> 16;
+  uint32_t full_mw = ((w * 1000) >> 16) * 100 / level;
+  if (full_mw == 0)
+    return scheduled;
+
+  int64_t available_j = charge_j - (int64_t) capacity_j * reserve_percent / 100;
+  uint64_t needed_j = (uint64_t) full_mw * scheduled / 100 * (night_length_s - since_dusk_s) / 1000;
+  if (available_j <= 0)
+    return min_level;
+  if ((uint64_t) available_j >= needed_j)
+    return scheduled;
+
+  unsigned int l = scheduled * available_j / needed_j;
+  return l < min_level ? min_level : l;
+}
+
+int lighting_enable(uint32_t rated, uint32_t capacity_wh)
+{
+  if (rated == 0 || capacity_wh == 0)
+    return 1;
+  if (regulator_get_mode(panel) == DISABLED)
+    return 3;
+  if (regulator_set_ch2_source(BATTERY))
+    return 2;
+  rated_ma = rated;
+  capacity_j = capacity_wh * 3600;
+  charge_j = capacity_j / 2; // unknown until the first full charge
+  last_in_j = regulator_get_energy(panel);
+  last_out_j = regulator_get_energy(led);
+  level = 0;
+  transition_pending = false;
+  state = LIGHTING_DAY;
+  return 0;
+}
+
+void lighting_disable(void)
+{
+  state = LIGHTING_OFF;
+  set_level(0);
+}
+
+void lighting_poll(void)
+{
+  if (state == LIGHTING_OFF || msTicks - last_poll_ms < poll_interval_ms)
+    return;
+  last_poll_ms = msTicks;
+
+  // without channel 1 the panel reads zero: it would look like night
+  // and dawn would never come
+  if (regulator_get_mode(panel) == DISABLED) {
+    lighting_disable();
+    return;
+  }
+  update_charge();
+
+  uint32_t t = now_s();
+  uint32_t mv = panel_mv();
+  bool past = state == LIGHTING_DAY ? mv < dusk_mv : mv > dawn_mv;
+  if (!past) {
+    transition_pending = false;
+  } else if (!transition_pending) {
+    transition_pending = true;
+    transition_since_s = t;
+  } else if (t - transition_since_s >= debounce_s) {
+    transition_pending = false;
+    if (state == LIGHTING_DAY) {
+      state = LIGHTING_NIGHT;
+      dusk_s = transition_since_s;
+    } else {
+      state = LIGHTING_DAY;
+      night_length_s = transition_since_s - dusk_s;
+      set_level(0);
+    }
+  }
+
+  if (state == LIGHTING_NIGHT) {
+    uint32_t since_dusk = t - dusk_s;
+    if (set_level(autonomy_level(scheduled_level(since_dusk), since_dusk)))
+      state = LIGHTING_OFF;
+  }
+}
+
+enum lighting_state lighting_get_state(void)
+{
+  return state;
+}
+
+unsigned int lighting_get_level(void)
+{
+  return level;
+}
+
+unsigned int lighting_get_soc(void)
+{
+  return capacity_j ? charge_j * 100 / capacity_j : 0;
+}
+
+/*
+ * A 100 Wh battery at half charge takes 10 Wh in and gives 30 Wh out,
+ * landing at 30%; a large charge then fills it and a large discharge
+ * empties it.
+ */
+int lighting_check(void)
+{
+  uint32_t saved_capacity = capacity_j;
+  int64_t saved_charge = charge_j;
+  const uint32_t wh = 3600;
+
+  capacity_j = 100 * wh;
+  charge_j = account(50 * wh, 10 * wh, 30 * wh);
+  bool ok = charge_j == 30 * wh && lighting_get_soc() == 30;
+  ok = ok && account(charge_j, 200 * wh, 0) == capacity_j;
+  ok = ok && account(charge_j, 0, 200 * wh) == 0;
+
+  capacity_j = saved_capacity;
+  charge_j = saved_charge;
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * LED lighting driver
+ *
+ * Runs channel 2 as a constant-current LED driver from the battery: the
+ * light comes on at dusk, follows a dimming schedule through the night
+ * and goes off at dawn. Dusk and dawn are detected from the panel-side
+ * voltage, and the level is reduced further when the battery's estimated
+ * charge would not last until the expected dawn.
+ */
+
+enum lighting_state { LIGHTING_OFF, LIGHTING_DAY, LIGHTING_NIGHT };
+
+// rated LED current at 100%, battery capacity for autonomy estimates;
+// channel 1 must be enabled, and lighting turns off if it is disabled or
+// channel 2 refuses current feedback
+int lighting_enable(uint32_t rated_ma, uint32_t capacity_wh);
+void lighting_disable(void);
+
+// run the schedule, call periodically from the main loop
+void lighting_poll(void);
+
+enum lighting_state lighting_get_state(void);
+unsigned int lighting_get_level(void);  // percent, multiple of 5
+unsigned int lighting_get_soc(void);    // estimated battery charge, percent
+
+// run the charge estimate through a known charge and discharge,
+// returns 0 if it lands where expected
+int lighting_check(void);
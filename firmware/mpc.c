@@ -0,0 +1,91 @@
+#include "mpc.h"
+
+#include <stdbool.h>
+
+/*
+ * Control law for channel 1
+ *
+ * Placeholder until a table generated from the plant model is available:
+ * it reproduces regulator_feedback_error at unit gain and full rate,
+ * region for region in the same order, including the fallback when the
+ * voltage collapses with both switches saturated. Regenerate with the
+ * offline solver and paste the region table here; the format is the only
+ * contract.
+ */
+#define FUDGE 2000 // as in regulator_feedback_error
+
+static const struct mpc_region chan1_regions[] = {
+  // voltage collapsed with both switches saturated: fall back to half duty
+  {
+    .n_constraints = 3,
+    .h = { { 1, 0, 0 }, { 0, 0, -1 }, { 0, -1, 0 } },
+    .k = { -1, -(0xffff - FUDGE + 1), -(0xffff - FUDGE + 1) },
+    .f = { { 0, 0, 0 }, { 0, 0, 0 } },
+    .g = { 0xffff/2, 0xffff/2 },
+  },
+  // voltage low with switch 1 saturated: raise switch 2
+  {
+    .n_constraints = 2,
+    .h = { { 1, 0, 0 }, { 0, -1, 0 } },
+    .k = { -1, -(0xffff - FUDGE + 1) },
+    .f = { { 0, 0x10000, 0 }, { -0x10000, 0, 0x10000 } },
+    .g = { 0, 0 },
+  },
+  // voltage high with switch 1 at the bottom: lower switch 2
+  {
+    .n_constraints = 2,
+    .h = { { 0, 1, 0 }, { -1, 0, 0 } },
+    .k = { FUDGE - 1, -1 },
+    .f = { { 0, 0x10000, 0 }, { -0x10000, 0, 0x10000 } },
+    .g = { 0, 0 },
+  },
+  // voltage low with switch 2 active
+  {
+    .n_constraints = 2,
+    .h = { { 1, 0, 0 }, { 0, 0, -1 } },
+    .k = { -1, -(FUDGE + 1) },
+    .f = { { 0, 0x10000, 0 }, { 0x10000, 0, 0x10000 } },
+    .g = { 0, 0 },
+  },
+  // everywhere else: regulate with switch 1
+  {
+    .n_constraints = 0,
+    .f = { { -0x10000, 0x10000, 0 }, { 0, 0, 0x10000 } },
+    .g = { 0, 0 },
+  },
+};
+
+const struct mpc_law mpc_chan1_law = {
+  .n_regions = sizeof(chan1_regions) / sizeof(chan1_regions[0]),
+  .regions = chan1_regions,
+};
+
+static bool region_contains(const struct mpc_region *r, const int32_t x[MPC_STATES])
+{
+  for (unsigned int i=0; i<r->n_constraints; i++) {
+    int64_t acc = 0;
+    for (unsigned int j=0; j<MPC_STATES; j++)
+      acc += (int64_t) r->h[i][j] * x[j];
+    if (acc > r->k[i])
+      return false;
+  }
+  return true;
+}
+
+int mpc_evaluate(const struct mpc_law *law, const int32_t x[MPC_STATES],
+                 int32_t u[MPC_INPUTS])
+{
+  for (unsigned int n=0; n<law->n_regions && n<MPC_MAX_REGIONS; n++) {
+    const struct mpc_region *r = &law->regions[n];
+    if (!region_contains(r, x))
+      continue;
+    for (unsigned int i=0; i<MPC_INPUTS; i++) {
+      int64_t acc = 0;
+      for (unsigned int j=0; j<MPC_STATES; j++)
+        acc += (int64_t) r->f[i][j] * x[j];
+      u[i] = (acc >> 16) + r->g[i];
+    }
+    return n;
+  }
+  return -1;
+}
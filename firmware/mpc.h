@@ -0,0 +1,39 @@
+#include <stdint.h>
+
+/*
+ * Explicit model predictive control
+ *
+ * The MPC problem for a channel is solved offline, giving a piecewise
+ * affine control law: the state space is partitioned into polyhedral
+ * regions and each region has its own affine feedback. Online we only
+ * find the region containing the state and apply its law. Regions are
+ * searched in order and the first match wins, so the cost is bounded by
+ * the table size.
+ *
+ * State x = (error [codepoints], duty1, duty2), input u = (duty1, duty2),
+ * duties in 0..0xffff.
+ */
+
+#define MPC_STATES 3
+#define MPC_INPUTS 2
+#define MPC_MAX_CONSTRAINTS 4
+#define MPC_MAX_REGIONS 16
+
+struct mpc_region {
+  uint8_t n_constraints;
+  int32_t h[MPC_MAX_CONSTRAINTS][MPC_STATES]; // region is h x <= k
+  int32_t k[MPC_MAX_CONSTRAINTS];
+  int32_t f[MPC_INPUTS][MPC_STATES];          // u = (f x >> 16) + g
+  int32_t g[MPC_INPUTS];
+};
+
+struct mpc_law {
+  unsigned int n_regions;
+  const struct mpc_region *regions;
+};
+
+extern const struct mpc_law mpc_chan1_law;
+
+// returns the index of the region used, or -1 if x lies in none (u untouched)
+int mpc_evaluate(const struct mpc_law *law, const int32_t x[MPC_STATES],
+                 int32_t u[MPC_INPUTS]);
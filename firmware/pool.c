@@ -0,0 +1,60 @@
+#include "pool.h"
+#include "usart.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+static struct pool_block blocks[POOL_BLOCKS];
+static volatile uint32_t free_mask = (1UL << POOL_BLOCKS) - 1;
+
+static volatile uint32_t in_use, peak, failures;
+
+struct pool_block *pool_alloc(void)
+{
+  uint32_t mask = __atomic_load_n(&free_mask, __ATOMIC_RELAXED);
+  while (mask) {
+    uint32_t bit = mask & -mask;
+    if (__atomic_compare_exchange_n(&free_mask, &mask, mask & ~bit, true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      struct pool_block *b = &blocks[__builtin_ctz(bit)];
+      b->refs = 1;
+      b->len = 0;
+
+      uint32_t n = __atomic_add_fetch(&in_use, 1, __ATOMIC_RELAXED);
+      uint32_t p = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+      while (n > p && !__atomic_compare_exchange_n(&peak, &p, n, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+      return b;
+    }
+    // mask was reloaded by the failed exchange
+  }
+
+  __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+void pool_ref(struct pool_block *b)
+{
+  __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+void pool_release(struct pool_block *b)
+{
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_RELEASE) != 0)
+    return;
+  __atomic_sub_fetch(&in_use, 1, __ATOMIC_RELAXED);
+  __atomic_or_fetch(&free_mask, 1UL << (b - blocks), __ATOMIC_RELEASE);
+}
+
+unsigned int pool_get_in_use(void) { return in_use; }
+unsigned int pool_get_peak(void) { return peak; }
+unsigned int pool_get_failures(void) { return failures; }
+
+void pool_report(void)
+{
+  print_value("pool blocks = ", POOL_BLOCKS, "\n");
+  print_value("block size = ", POOL_BLOCK_SIZE, "\n");
+  print_value("in use = ", pool_get_in_use(), "\n");
+  print_value("peak = ", pool_get_peak(), "\n");
+  print_value("failures = ", pool_get_failures(), "\n");
+}
@@ -0,0 +1,31 @@
+#include <stdint.h>
+
+/*
+ * Shared message buffer pool
+ *
+ * Fixed-size, reference-counted blocks handed between producers (ISRs,
+ * console, logger) and consumers (UART DMA, EEPROM writer) without
+ * copying. Allocation and release are lock-free and safe from any
+ * context.
+ */
+
+#define POOL_BLOCK_SIZE 64
+#define POOL_BLOCKS 8
+
+struct pool_block {
+  volatile uint8_t refs;
+  uint8_t len;  // bytes of data in use
+  char data[POOL_BLOCK_SIZE];
+};
+
+// returns a block with one reference or NULL if the pool is exhausted
+struct pool_block *pool_alloc(void);
+void pool_ref(struct pool_block *b);
+// drops a reference, returning the block to the pool on the last one
+void pool_release(struct pool_block *b);
+
+unsigned int pool_get_in_use(void);
+unsigned int pool_get_peak(void);
+unsigned int pool_get_failures(void);
+
+void pool_report(void);
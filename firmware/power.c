@@ -0,0 +1,150 @@
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+
+#include "config.h"
+#include "power.h"
+#include "clock.h"
+#include "usart.h"
+
+static const uint32_t vdd_mv = 3300;
+
+/*
+ * Typical supply currents of the STM32L151x6 at 16 MHz from HSI, range 1.
+ * These are datasheet typicals, not measurements; the estimate is only as
+ * good as the table.
+ */
+static const uint32_t state_ua[N_POWER_STATES] = {
+  [POWER_RUN]    = 3700,
+  [POWER_SLEEP]  = 1000,
+};
+
+struct periph_clock {
+  volatile uint32_t *reg;
+  uint32_t en;
+  uint32_t ua; // additional current while clocked
+  const char *name;
+};
+
+static const struct periph_clock periphs[N_POWER_PERIPHS] = {
+  [PERIPH_ADC1]   = { &RCC_APB2ENR, RCC_APB2ENR_ADC1EN,   1600, "adc1" }, // includes analog and HSI
+  [PERIPH_TIM2]   = { &RCC_APB1ENR, RCC_APB1ENR_TIM2EN,    165, "tim2" },
+  [PERIPH_TIM3]   = { &RCC_APB1ENR, RCC_APB1ENR_TIM3EN,    165, "tim3" },
+  [PERIPH_TIM4]   = { &RCC_APB1ENR, RCC_APB1ENR_TIM4EN,    165, "tim4" },
+  [PERIPH_TIM6]   = { &RCC_APB1ENR, RCC_APB1ENR_TIM6EN,     60, "tim6" },
+  [PERIPH_TIM7]   = { &RCC_APB1ENR, RCC_APB1ENR_TIM7EN,     60, "tim7" },
+  [PERIPH_I2C1]   = { &RCC_APB1ENR, RCC_APB1ENR_I2C1EN,    115, "i2c1" },
+  [PERIPH_USART1] = { &RCC_APB2ENR, RCC_APB2ENR_USART1EN,  175, "usart1" },
+};
+
+static const char* const state_names[N_POWER_STATES] = {
+  "run", "sleep"
+};
+
+static enum power_state cur_state = POWER_RUN;
+static uint32_t state_since_us;
+static uint64_t state_us[N_POWER_STATES];
+
+static uint32_t periph_since_ms[N_POWER_PERIPHS];
+static uint32_t periph_ms[N_POWER_PERIPHS];
+static uint8_t periph_on[N_POWER_PERIPHS];
+
+static int find_periph(volatile uint32_t *reg, uint32_t en)
+{
+  for (int i=0; i<N_POWER_PERIPHS; i++)
+    if (periphs[i].reg == reg && periphs[i].en == en)
+      return i;
+  return -1;
+}
+
+void power_enable_clock(volatile uint32_t *reg, uint32_t en)
+{
+  rcc_peripheral_enable_clock(reg, en);
+  int i = find_periph(reg, en);
+  if (i < 0 || periph_on[i]) return;
+  periph_on[i] = 1;
+  periph_since_ms[i] = msTicks;
+}
+
+void power_disable_clock(volatile uint32_t *reg, uint32_t en)
+{
+  rcc_peripheral_disable_clock(reg, en);
+  int i = find_periph(reg, en);
+  if (i < 0 || !periph_on[i]) return;
+  periph_on[i] = 0;
+  periph_ms[i] += msTicks - periph_since_ms[i];
+}
+
+void power_set_state(enum power_state state)
+{
+  uint32_t now = uptime_us();
+  state_us[cur_state] += now - state_since_us;
+  state_since_us = now;
+  cur_state = state;
+}
+
+/*
+ * The console polls the USART rather than taking its interrupt, so we
+ * sleep with WFE and SEVONPEND: the RXNE request pends in the NVIC without
+ * being serviced, and the pending edge wakes us.
+ */
+void power_sleep(void)
+{
+  SCB_SCR |= SCB_SCR_SEVEONPEND;
+  nvic_clear_pending_irq(NVIC_USART1_IRQ);
+  power_set_state(POWER_SLEEP);
+  __asm__ volatile ("wfe");
+  power_set_state(POWER_RUN);
+}
+
+uint32_t power_get_state_ms(enum power_state state)
+{
+  uint64_t us = state_us[state];
+  if (state == cur_state)
+    us += uptime_us() - state_since_us;
+  return us / 1000;
+}
+
+uint32_t power_get_periph_ms(enum power_periph periph)
+{
+  uint32_t ms = periph_ms[periph];
+  if (periph_on[periph])
+    ms += msTicks - periph_since_ms[periph];
+  return ms;
+}
+
+uint32_t power_get_avg_uw(void)
+{
+  uint64_t total_ms = 0, charge = 0; // charge in uA ms
+  for (int i=0; i<N_POWER_STATES; i++) {
+    uint32_t ms = power_get_state_ms(i);
+    total_ms += ms;
+    charge += (uint64_t) ms * state_ua[i];
+  }
+  for (int i=0; i<N_POWER_PERIPHS; i++)
+    charge += (uint64_t) power_get_periph_ms(i) * periphs[i].ua;
+
+  if (total_ms == 0) return 0;
+  return charge * vdd_mv / 1000 / total_ms;
+}
+
+void power_report(void)
+{
+  char buf[24];
+  format_timestamp(buf, monotonic_us());
+  usart_print("t = ");
+  usart_print(buf);
+  usart_print("\n");
+  for (int i=0; i<N_POWER_STATES; i++) {
+    usart_print(state_names[i]);
+    print_value(" = ", power_get_state_ms(i), " ms\n");
+  }
+  for (int i=0; i<N_POWER_PERIPHS; i++) {
+    usart_print(periphs[i].name);
+    print_value(" = ", power_get_periph_ms(i), " ms\n");
+  }
+
+  uint32_t uw = power_get_avg_uw();
+  print_value("average power = ", uw, " uW\n");
+  print_value("energy per day = ", (uint64_t) uw * 86400 / 1000000, " J\n");
+}
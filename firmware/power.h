@@ -0,0 +1,44 @@
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * MCU power accounting
+ *
+ * Tracks residency in each power state and of each switched peripheral
+ * clock, and estimates the controller's own consumption from typical
+ * datasheet currents.
+ */
+
+enum power_state {
+  POWER_RUN, POWER_SLEEP, N_POWER_STATES
+};
+
+enum power_periph {
+  PERIPH_ADC1, PERIPH_TIM2, PERIPH_TIM3, PERIPH_TIM4, PERIPH_TIM6, PERIPH_TIM7,
+  PERIPH_I2C1, PERIPH_USART1, N_POWER_PERIPHS
+};
+
+#if CONFIG_POWER
+// drop-in replacements for rcc_peripheral_{enable,disable}_clock
+void power_enable_clock(volatile uint32_t *reg, uint32_t en);
+void power_disable_clock(volatile uint32_t *reg, uint32_t en);
+
+void power_set_state(enum power_state state);
+
+// sleep until the next event (interrupt or pending interrupt)
+void power_sleep(void);
+#else
+#define power_enable_clock rcc_peripheral_enable_clock
+#define power_disable_clock rcc_peripheral_disable_clock
+#define power_set_state(state) do {} while (0)
+#define power_sleep() do {} while (0)
+#endif
+
+uint32_t power_get_state_ms(enum power_state state);
+uint32_t power_get_periph_ms(enum power_periph periph);
+
+// average MCU consumption since boot
+uint32_t power_get_avg_uw(void);
+
+void power_report(void);
@@ -1,21 +1,87 @@
+#include <stddef.h>
+#include <string.h>
+
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/l1/adc.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
 
+#include "config.h"
 #include "regulator.h"
+#include "power.h"
+#include "biquad.h"
+#include "mpc.h"
+#include "capture.h"
+#include "clock.h"
 
 static const uint32_t vsense1_ch = ADC_CHANNEL4;
 static const uint32_t isense1_ch = ADC_CHANNEL3;
 static const uint32_t vsense2_ch = ADC_CHANNEL21;
 static const uint32_t isense2_ch = ADC_CHANNEL20;
+static const uint32_t vth_ch = ADC_CHANNEL18;
 
 static enum tim_oc_id ch2_oc = TIM_OC3;
 
+on_sample_cb on_sample;
+
+static struct selftest_result selftest = { .failures = SELFTEST_NOT_RUN };
+static struct regulator_t *selftest_reg;  // channel being pulsed, or NULL
+static volatile bool selftest_cut;
+static uint16_t selftest_cut_code;
+static void self_test_cut(void);
+
+// self-test failures that keep a channel out of the feedback modes; a
+// missing source only says what the test could not check, since a panel
+// at night reads the same
+static uint16_t selftest_failures(struct regulator_t *reg)
+{
+  uint16_t mask = SELFTEST_NO_SENSE_SUPPLY | SELFTEST_NOT_RUN;
+  if (reg == &chan1)
+    mask |= SELFTEST_OPEN(SELFTEST_CH1_A) | SELFTEST_OPEN(SELFTEST_CH1_B)
+      | SELFTEST_SHORT(SELFTEST_CH1_A) | SELFTEST_SHORT(SELFTEST_CH1_B);
+  else
+    mask |= SELFTEST_OPEN(SELFTEST_CH2_BATT) | SELFTEST_OPEN(SELFTEST_CH2_PANEL)
+      | SELFTEST_SHORT(SELFTEST_CH2_BATT) | SELFTEST_SHORT(SELFTEST_CH2_PANEL);
+  return selftest.failures & mask;
+}
+
 struct feedback_gains {
   fixed32_t prop_gain1, prop_gain2; // gains for each channel
 };
+
+/*
+ * Maximum power point tracking (perturb and observe)
+ *
+ * Both channels can track a panel string at once (channel 2 with its
+ * source set to INPUT) while sharing the battery. A step on one channel
+ * moves the battery voltage and so the other channel's power, so the
+ * trackers take turns within a cycle of 4 * MPPT_WINDOW samples: each
+ * measures its power over one window, steps duty1, lets the step settle
+ * for half a window, measures again and keeps going the same way only if
+ * power rose. The other tracker holds still throughout.
+ */
+struct mppt_state {
+  unsigned int offset;     // start of this channel's turn within the cycle
+  int32_t step;            // signed duty1 step
+  uint32_t before, after;  // summed vsense * isense
+  bool primed;             // before and after cover whole windows
+};
+
+/*
+ * Gain schedule
+ *
+ * Plant gain varies with duty cycle and input voltage, so the mode's gains
+ * are multiplied by a Q8.8 factor interpolated from a grid of nodes over
+ * duty1 and vsense. The applied factor slews towards the interpolated one
+ * so that crossing between entries is bumpless.
+ */
+struct gain_schedule {
+  bool enabled;
+  uint16_t scale[SCHEDULE_DUTY_NODES][SCHEDULE_VSENSE_NODES];
+  uint16_t current; // factor currently applied
+};
   
 /*
  * This ties together the various parameters needed by a single
@@ -34,12 +100,26 @@ struct regulator_t {
   uint16_t vsetpoint, ilimit; // in codepoints, only used in voltage_fb mode
   struct feedback_gains i_gains, v_gains;
   fixed32_t i1_prop_gain, i2_prop_gain; // current feedback gains
+  int32_t last_error; // feedback error of previous sample
+  bool limiting; // a limit fold-back overrode the loop on the last sample
+  uint16_t last_vsense, last_isense; // previous sample, for rate adaptation
+#if CONFIG_BIQUAD
+  struct biquad_chain error_filter; // applied to the feedback error
+#endif
+  struct mppt_state mppt;
+  uint64_t energy; // harvested vsense * isense * full-rate samples
+#if CONFIG_GAIN_SCHEDULE
+  struct gain_schedule schedule;
+#endif
   void (*enable_func)(void);
   int (*configure_func)(void);
   void (*disable_func)(void);
   void (*update_duty_func)(void);
 };
 
+#define MPPT_WINDOW 32
+#define MPPT_STEP 0x100
+
 static void enable_ch1(void);
 static int configure_ch1(void);
 static void disable_ch1(void);
@@ -47,6 +127,7 @@ static void update_duty_ch1(void);
 
 struct regulator_t chan1 = {
   .period = 2000000 / 5000,
+  .mppt = { .offset = 0, .step = MPPT_STEP },
   .mode = DISABLED,
   .vsense_gain = (1<<12) / 3.3 * 33/(33+68),
   .isense_gain = (1<<12) / (3.3 / 0.05 / 10),
@@ -67,6 +148,7 @@ static void update_duty_ch2(void);
 
 struct regulator_t chan2 = {
   .period = 2000000 / 5000,
+  .mppt = { .offset = 2 * MPPT_WINDOW, .step = MPPT_STEP },
   .mode = DISABLED,
   .vsense_gain = (1<<12) / 3.3 * 33/(33+68),
   .isense_gain = (1<<12) / (3.3 / 0.05 / 47),
@@ -104,6 +186,79 @@ struct regulator_t chan2 = {
  *
  */
 
+/*
+ * Adaptive loop rate
+ *
+ * At steady state there is little point in sampling and correcting at the
+ * full loop rate. Once every active loop has kept its error and its
+ * sample-to-sample variation inside quiet_window for quiet_samples
+ * consecutive samples, the TIM7 trigger period is doubled, down to
+ * 1 / (1 << max_rate_shift) of the full rate. Any sample outside the window,
+ * or on which a limit fold-back overrode a loop, restores the full rate
+ * immediately. Maximum power tracking always runs at the full rate.
+ *
+ * The proportional correction is applied once per sample and so acts as an
+ * integrator; its gain is scaled by the period ratio to keep the loop
+ * crossover unchanged.
+ */
+// TIM7 counts CLOCKRATE / 2 (prescaler 1); its period at full rate
+#define LOOP_TICK_HZ (CLOCKRATE / 2)
+static const uint32_t loop_period = LOOP_TICK_HZ / REGULATOR_LOOP_RATE;
+
+static unsigned int rate_shift = 0; // loop runs at full rate >> rate_shift
+static unsigned int quiet_count = 0;
+
+#if CONFIG_ADAPTIVE_RATE
+static const unsigned int max_rate_shift = 3;
+static const unsigned int quiet_samples = 256;
+static const int32_t quiet_window = 8; // codepoints
+
+static void set_rate_shift(unsigned int shift)
+{
+  rate_shift = shift;
+  quiet_count = 0;
+  timer_set_period(TIM7, loop_period << shift);
+  if (shift == 0) {
+    // restart the period now rather than waiting out a long one
+    timer_generate_event(TIM7, TIM_EGR_UG);
+  }
+}
+
+static int32_t abs32(int32_t x)
+{
+  return x < 0 ? -x : x;
+}
+
+static bool regulator_is_quiet(struct regulator_t *reg)
+{
+  // the trackers' windows and steps are counted in samples, and a slower
+  // loop would slow both the tracking and the limit fold-back
+  if (reg->limiting || reg->mode == MAX_POWER)
+    return false;
+  if (reg->mode != VOLTAGE_FB && reg->mode != CURRENT_FB && reg->mode != MPC_FB)
+    return true;
+#if CONFIG_BIQUAD
+  // filter coefficients are designed for the full loop rate
+  if (reg->error_filter.n)
+    return false;
+#endif
+  return abs32(reg->last_error) < quiet_window
+    && abs32(reg->vsense - reg->last_vsense) < quiet_window
+    && abs32(reg->isense - reg->last_isense) < quiet_window;
+}
+
+static void update_loop_rate(void)
+{
+  if (!regulator_is_quiet(&chan1) || !regulator_is_quiet(&chan2)) {
+    if (rate_shift != 0)
+      set_rate_shift(0);
+    quiet_count = 0;
+  } else if (rate_shift < max_rate_shift && ++quiet_count >= quiet_samples) {
+    set_rate_shift(rate_shift + 1);
+  }
+}
+#endif
+
 static void setup_common_peripherals(void)
 {
   uint8_t sequence[] = { vsense1_ch, isense1_ch, vsense2_ch, isense2_ch };
@@ -111,16 +266,16 @@ static void setup_common_peripherals(void)
   if (chan1.mode == DISABLED && chan2.mode == DISABLED) {
     if (RCC_APB2ENR & RCC_APB2ENR_ADC1EN)
       adc_off(ADC1);
-    rcc_peripheral_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM7EN);
-    rcc_peripheral_disable_clock(&RCC_APB2ENR, RCC_APB2ENR_ADC1EN);
+    power_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM7EN);
+    power_disable_clock(&RCC_APB2ENR, RCC_APB2ENR_ADC1EN);
     rcc_osc_off(HSI);
   } else {
     // ADCCLK is derived from HSI
     rcc_osc_on(HSI);
     rcc_wait_for_osc_ready(HSI);
 
-    rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM7EN);
-    rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_ADC1EN);
+    power_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM7EN);
+    power_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_ADC1EN);
 
     nvic_enable_irq(NVIC_ADC1_IRQ);
     adc_enable_external_trigger_injected(ADC1, ADC_CR2_JEXTEN_RISING,
@@ -137,8 +292,10 @@ static void setup_common_peripherals(void)
 
     timer_reset(TIM7);
     timer_continuous_mode(TIM7);
-    timer_set_prescaler(TIM7, 0x1);
-    timer_set_period(TIM7, 2097000 / 1000);
+    timer_set_prescaler(TIM7, 0x1); // LOOP_TICK_HZ
+    timer_set_period(TIM7, loop_period);
+    rate_shift = 0;
+    quiet_count = 0;
     timer_set_master_mode(TIM7, TIM_CR2_MMS_UPDATE);
     timer_enable_counter(TIM7);
   }
@@ -225,7 +382,7 @@ static int configure_dual_pwm(uint32_t timer_a, enum tim_oc_id oc_a,
 }
 
 static void regulator_feedback_error(struct regulator_t *reg,
-                                     struct feedback_gains *gains,
+                                     const struct feedback_gains *gains,
                                      int32_t error
 ) {
   const int32_t fudge = 2000;
@@ -236,16 +393,16 @@ static void regulator_feedback_error(struct regulator_t *reg,
     reg->duty2 = 0xffff/2;
   } else if (error < 0 && reg->duty1 > 0xffff - fudge) {
     // switch 1 overflow, start increasing switch 2
-    reg->duty2 -= ((int64_t) error * gains->prop_gain2) >> 16;
+    reg->duty2 -= ((int64_t) error * gains->prop_gain2) >> (16 - rate_shift);
   } else if (error > 0 && reg->duty1 < fudge) {
     // switch 1 underflow, start decreasing switch 2
-    reg->duty2 -= ((int64_t) error * gains->prop_gain2) >> 16;
+    reg->duty2 -= ((int64_t) error * gains->prop_gain2) >> (16 - rate_shift);
   } else if (error < 0 && reg->duty2 > fudge) {
     // ???
-    reg->duty2 += ((int64_t) error * gains->prop_gain2) >> 16;
+    reg->duty2 += ((int64_t) error * gains->prop_gain2) >> (16 - rate_shift);
   } else {
     // normal operating conditions, regulate with switch 1
-    reg->duty1 -= ((int64_t) error * gains->prop_gain1) >> 16;
+    reg->duty1 -= ((int64_t) error * gains->prop_gain1) >> (16 - rate_shift);
   }
 
   // Ensure switch 2 is never on when switch 1 is off
@@ -253,27 +410,142 @@ static void regulator_feedback_error(struct regulator_t *reg,
     reg->duty2 = reg->duty1;
 }                                     
 
+static int32_t filter_error(struct regulator_t *reg, int32_t error)
+{
+#if CONFIG_BIQUAD
+  return biquad_chain_step(&reg->error_filter, error);
+#else
+  (void) reg;
+  return error;
+#endif
+}
+
+#if CONFIG_GAIN_SCHEDULE
+static const uint16_t schedule_unity = 0x100;
+static const uint16_t schedule_slew = 0x8; // per sample
+
+static uint32_t schedule_lookup(struct gain_schedule *s, fract32_t duty, uint16_t vsense)
+{
+  // nodes are 0x4000 apart in duty and 1024 codepoints apart in vsense
+  uint32_t d = duty < 0 ? 0 : duty > 0xffff ? 0xffff : duty;
+  uint32_t v = vsense > 0xfff ? 0xfff : vsense;
+  unsigned int di = d >> 14, dx = d & 0x3fff;
+  unsigned int vi = v >> 10, vx = v & 0x3ff;
+
+  uint32_t lo = (s->scale[di][vi] * (0x4000 - dx) + s->scale[di+1][vi] * dx) >> 14;
+  uint32_t hi = (s->scale[di][vi+1] * (0x4000 - dx) + s->scale[di+1][vi+1] * dx) >> 14;
+  return (lo * (0x400 - vx) + hi * vx) >> 10;
+}
+
+static const struct feedback_gains *schedule_gains(struct regulator_t *reg,
+                                                   const struct feedback_gains *gains,
+                                                   struct feedback_gains *scaled)
+{
+  struct gain_schedule *s = &reg->schedule;
+  uint32_t target = s->enabled
+    ? schedule_lookup(s, reg->duty1, reg->vsense) : schedule_unity;
+
+  if (target > s->current + schedule_slew)
+    s->current += schedule_slew;
+  else if (target + schedule_slew < s->current)
+    s->current -= schedule_slew;
+  else
+    s->current = target;
+
+  if (s->current == schedule_unity)
+    return gains;
+  scaled->prop_gain1 = ((int64_t) gains->prop_gain1 * s->current) >> 8;
+  scaled->prop_gain2 = ((int64_t) gains->prop_gain2 * s->current) >> 8;
+  return scaled;
+}
+#else
+static const struct feedback_gains *schedule_gains(struct regulator_t *reg,
+                                                   const struct feedback_gains *gains,
+                                                   struct feedback_gains *scaled)
+{
+  (void) reg; (void) scaled;
+  return gains;
+}
+#endif
+
+static unsigned int mppt_cycle; // sample within the MPPT cycle
+
+static void regulator_mppt(struct regulator_t *reg)
+{
+  struct mppt_state *m = &reg->mppt;
+  unsigned int t = (mppt_cycle + 4 * MPPT_WINDOW - m->offset) % (4 * MPPT_WINDOW);
+  uint32_t p = (uint32_t) reg->vsense * reg->isense;
+
+  if (t < MPPT_WINDOW) {
+    m->before += p;
+  } else if (t == MPPT_WINDOW) {
+    reg->duty1 += m->step;
+  } else if (2 * t >= 3 * MPPT_WINDOW && t < 2 * MPPT_WINDOW) {
+    m->after += p;
+  } else if (t == 2 * MPPT_WINDOW) {
+    // the after window is half as long as the before window
+    if (m->primed && 2 * m->after < m->before)
+      m->step = -m->step;
+    m->before = 0;
+    m->after = 0;
+    m->primed = true;
+  }
+}
+
 static void regulator_feedback(struct regulator_t *reg)
 {
+  struct feedback_gains scaled;
+
+  reg->limiting = false;
   if (reg->mode == DISABLED) {
     return;
   } else if (reg->mode == CONST_DUTY) {
     return;
+  } else if (reg->mode == MAX_POWER) {
+    if (reg->vsense > reg->vlimit || reg->isense > reg->ilimit) {
+      reg->limiting = true;
+      reg->duty1 -= MPPT_STEP;
+      reg->duty2 = 0;
+    } else {
+      regulator_mppt(reg);
+    }
   } else if (reg->mode == VOLTAGE_FB) {
     if (reg->isense > reg->ilimit) {
+      reg->last_error = reg->isense - reg->ilimit;
+      reg->limiting = true;
+      reg->duty1 /= 2;
+      reg->duty2 /= 2;
+    } else {
+      int32_t error = filter_error(reg, reg->vsense - reg->vsetpoint);
+      reg->last_error = error;
+      regulator_feedback_error(reg, schedule_gains(reg, &reg->v_gains, &scaled), error);
+    }
+#if CONFIG_MPC
+  } else if (reg->mode == MPC_FB) {
+    if (reg->isense > reg->ilimit) {
+      reg->last_error = reg->isense - reg->ilimit;
+      reg->limiting = true;
       reg->duty1 /= 2;
       reg->duty2 /= 2;
     } else {
-      int32_t error = reg->vsense - reg->vsetpoint;
-      regulator_feedback_error(reg, &reg->v_gains, error);
+      int32_t x[MPC_STATES] = { reg->vsense - reg->vsetpoint, reg->duty1, reg->duty2 };
+      int32_t u[MPC_INPUTS] = { reg->duty1, reg->duty2 };
+      reg->last_error = x[0];
+      mpc_evaluate(&mpc_chan1_law, x, u);
+      reg->duty1 = u[0];
+      reg->duty2 = u[1] > u[0] ? u[0] : u[1];
     }
+#endif
   } else if (reg->mode == CURRENT_FB) {
     if (reg->vsense > reg->vlimit) {
+      reg->last_error = reg->vsense - reg->vlimit;
+      reg->limiting = true;
       reg->duty1 /= 2;
       reg->duty2 /= 2;
     } else {
-      int32_t error = reg->isense - reg->isetpoint;
-      regulator_feedback_error(reg, &reg->i_gains, error);
+      int32_t error = filter_error(reg, reg->isense - reg->isetpoint);
+      reg->last_error = error;
+      regulator_feedback_error(reg, schedule_gains(reg, &reg->i_gains, &scaled), error);
     }
   }
 
@@ -314,8 +586,8 @@ static void set_vsense1_en(bool enabled)
 static void enable_ch1(void)
 {
   set_vsense1_en(true);
-  rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM2EN);
-  rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM4EN);
+  power_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM2EN);
+  power_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM4EN);
   setup_common_peripherals();
 }
 
@@ -325,8 +597,8 @@ static void disable_ch1(void)
   timer_disable_oc_output(TIM4, TIM_OC3);
   timer_disable_counter(TIM2);
   timer_disable_counter(TIM4);
-  rcc_peripheral_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM2EN);
-  rcc_peripheral_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM4EN);
+  power_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM2EN);
+  power_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM4EN);
   setup_common_peripherals();
   set_vsense1_en(false);
 }
@@ -364,7 +636,7 @@ static int configure_ch2()
  
 static void enable_ch2(void)
 {
-  rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM3EN);
+  power_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM3EN);
   setup_common_peripherals();
 }
 
@@ -373,13 +645,22 @@ static void disable_ch2(void)
   timer_disable_oc_output(TIM3, TIM_OC1);
   timer_disable_oc_output(TIM3, TIM_OC3);
   timer_disable_counter(TIM3);
-  rcc_peripheral_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM3EN);
+  power_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_TIM3EN);
   setup_common_peripherals();
 }
 
+/*
+ * Channel 2 drives LED strings at low currents where one timer count is
+ * a large step in current, so the fraction of a count lost in
+ * set_pwm_duty is carried over to the next update (first-order dither).
+ */
+static uint32_t ch2_dither;
+
 static void update_duty_ch2(void) 
 {
-  set_pwm_duty(TIM3, ch2_oc, chan2.period, chan2.duty1);
+  uint32_t t = (uint32_t) chan2.duty1 * chan2.period + ch2_dither;
+  ch2_dither = t & 0xffff;
+  timer_set_oc_value(TIM3, ch2_oc, t >> 16);
 }
 
 
@@ -388,13 +669,67 @@ static void update_duty_ch2(void)
  *******************************/
 void adc1_isr(void)
 {
-  ADC1_SR &= ~ADC_SR_JEOC;
+  // the flags are cleared by writing 0, so write 1 to the rest: a
+  // read-modify-write would lose an EOC that lands in between
+  if ((ADC1_SR & ADC_SR_AWD) && selftest_reg)
+    self_test_cut();
+  if (!(ADC1_SR & ADC_SR_JEOC))
+    return;
+  ADC1_SR = ~ADC_SR_JEOC;
+  chan1.last_vsense = chan1.vsense;
+  chan1.last_isense = chan1.isense;
+  chan2.last_vsense = chan2.vsense;
+  chan2.last_isense = chan2.isense;
   chan1.vsense = adc_read_injected(ADC1, 1);
   chan1.isense = adc_read_injected(ADC1, 2);
   chan2.vsense = adc_read_injected(ADC1, 3);
   chan2.isense = adc_read_injected(ADC1, 4);
   regulator_feedback(&chan1);
   regulator_feedback(&chan2);
+  mppt_cycle = (mppt_cycle + 1) % (4 * MPPT_WINDOW);
+  if (chan1.mode != DISABLED)
+    chan1.energy += ((uint32_t) chan1.vsense * chan1.isense) << rate_shift;
+  if (chan2.mode != DISABLED)
+    chan2.energy += ((uint32_t) chan2.vsense * chan2.isense) << rate_shift;
+#if CONFIG_ADAPTIVE_RATE
+  update_loop_rate();
+#endif
+  if (on_sample) on_sample();
+}
+
+uint32_t regulator_get_energy(struct regulator_t *reg)
+{
+  nvic_disable_irq(NVIC_ADC1_IRQ);
+  uint64_t energy = reg->energy;
+  nvic_enable_irq(NVIC_ADC1_IRQ);
+  // a full-rate sample lasts loop_period TIM7 ticks
+  uint32_t samples_per_s = LOOP_TICK_HZ / loop_period;
+  return energy / ((uint64_t) reg->vsense_gain * reg->isense_gain * samples_per_s);
+}
+
+unsigned int regulator_get_loop_rate(void)
+{
+  return REGULATOR_LOOP_RATE >> rate_shift;
+}
+
+unsigned int regulator_get_loop_slack_us(void)
+{
+  if (chan1.mode == DISABLED && chan2.mode == DISABLED)
+    return UINT32_MAX;
+  // both in TIM7 ticks, whatever the rate shift
+  uint32_t arr = TIM_ARR(TIM7), cnt = TIM_CNT(TIM7);
+  return cnt >= arr ? 0 : (arr - cnt) / (LOOP_TICK_HZ / 1000000);
+}
+
+// whether a channel may not enter a mode with channel 2 switching on oc
+static bool mode_refused(struct regulator_t *reg, enum feedback_mode mode, enum tim_oc_id oc)
+{
+  if (mode == MPC_FB && (!CONFIG_MPC || reg != &chan1))
+    return true;
+  // channel 2 can only track a panel when it switches on the panel side
+  if (mode == MAX_POWER && reg == &chan2 && oc != TIM_OC3)
+    return true;
+  return mode != DISABLED && mode != CONST_DUTY && selftest_failures(reg);
 }
 
 int regulator_set_mode(struct regulator_t *reg, enum feedback_mode mode)
@@ -402,6 +737,18 @@ int regulator_set_mode(struct regulator_t *reg, enum feedback_mode mode)
   int ret;
   enum feedback_mode old_mode = reg->mode;
 
+  if (mode_refused(reg, mode, ch2_oc))
+    return -1;
+
+#if CONFIG_BIQUAD
+  biquad_chain_reset(&reg->error_filter);
+#endif
+  if (mode == MAX_POWER && old_mode != MAX_POWER) {
+    // the sums may hold a stale turn, and entry may fall mid-window
+    reg->mppt.before = 0;
+    reg->mppt.after = 0;
+    reg->mppt.primed = false;
+  }
   reg->mode = mode;
   if (old_mode == DISABLED && mode != DISABLED)
     reg->enable_func();
@@ -483,15 +830,323 @@ fixed32_t regulator_get_isense(struct regulator_t *reg)
   return (reg->isense << 16) / reg->isense_gain;
 }
 
+fixed32_t regulator_get_ilimit(struct regulator_t *reg)
+{
+  return ((uint32_t) reg->ilimit << 16) / reg->isense_gain;
+}
+
+#if CONFIG_GAIN_SCHEDULE
+/*******************************
+ * Gain schedule
+ *******************************/
+static void schedule_init(struct gain_schedule *s)
+{
+  s->enabled = false;
+  s->current = schedule_unity;
+  for (int i=0; i<SCHEDULE_DUTY_NODES; i++)
+    for (int j=0; j<SCHEDULE_VSENSE_NODES; j++)
+      s->scale[i][j] = schedule_unity;
+}
+
+int regulator_set_schedule_node(struct regulator_t *reg, unsigned int duty_node,
+                                unsigned int vsense_node, unsigned int scale)
+{
+  if (duty_node >= SCHEDULE_DUTY_NODES || vsense_node >= SCHEDULE_VSENSE_NODES)
+    return 1;
+  if (scale == 0 || scale > 0xffff)
+    return 2;
+  reg->schedule.scale[duty_node][vsense_node] = scale;
+  return 0;
+}
+
+unsigned int regulator_get_schedule_node(struct regulator_t *reg, unsigned int duty_node,
+                                         unsigned int vsense_node)
+{
+  if (duty_node >= SCHEDULE_DUTY_NODES || vsense_node >= SCHEDULE_VSENSE_NODES)
+    return 0;
+  return reg->schedule.scale[duty_node][vsense_node];
+}
+
+void regulator_enable_schedule(struct regulator_t *reg, bool enabled)
+{
+  reg->schedule.enabled = enabled;
+}
+
+unsigned int regulator_get_schedule_scale(struct regulator_t *reg)
+{
+  return reg->schedule.current;
+}
+#endif
+
+/*
+ * Thermistor
+ *
+ * Assumes a 10k B3950 NTC to ground with a 10k pull-up, tabulated every
+ * 10 C from -20 C. Read as a regular conversion between the injected
+ * control-loop conversions, so the ADC must be running (a channel enabled).
+ */
+static const uint16_t vth_table[] = {
+  3741, 3496, 3157, 2739, 2278, 1825, 1419, 1082, 816, 613, 462
+};
+
+static const uint32_t regular_timeout_us = 500; // well past 4 injected slots
+
+// single regular conversion, alongside the injected loop conversions,
+// returns 0 on success
+static int read_regular(uint8_t ch, uint16_t *code)
+{
+  uint8_t seq[] = { ch };
+  adc_set_regular_sequence(ADC1, 1, seq);
+  // drop a stale EOC, e.g. left by a burst capture
+  ADC1_SR = ~ADC_SR_EOC;
+  adc_start_conversion_regular(ADC1);
+  uint32_t start = uptime_us();
+  while (!adc_eoc(ADC1))
+    if (uptime_us() - start > regular_timeout_us)
+      return -1;
+  *code = adc_read_regular(ADC1);
+  return 0;
+}
+
+static void sense_channels(struct regulator_t *reg, uint8_t *vch, uint8_t *ich)
+{
+  *vch = reg == &chan1 ? vsense1_ch : vsense2_ch;
+  *ich = reg == &chan1 ? isense1_ch : isense2_ch;
+}
+
+int regulator_get_temperature(int *decicelsius)
+{
+  if (!(RCC_APB2ENR & RCC_APB2ENR_ADC1EN))
+    return -1;
+#if CONFIG_CAPTURE
+  if (capture_busy())
+    return -1;
+#endif
+
+  uint16_t code;
+  if (read_regular(vth_ch, &code))
+    return -1;
+
+  const unsigned int n = sizeof(vth_table) / sizeof(vth_table[0]);
+  if (code >= vth_table[0]) {
+    *decicelsius = -200;
+  } else if (code <= vth_table[n-1]) {
+    *decicelsius = -200 + 100 * (n-1);
+  } else {
+    unsigned int i = 0;
+    while (code < vth_table[i+1]) i++;
+    *decicelsius = -200 + 100 * i
+      + 100 * (vth_table[i] - code) / (vth_table[i] - vth_table[i+1]);
+  }
+  return 0;
+}
+
+/*******************************
+ * Self-test
+ *******************************/
+static const fract32_t selftest_duty = 0x1000;
+static const unsigned int selftest_settle_ms = 2;
+static const unsigned int selftest_pulse_ms = 5;
+static const fixed32_t selftest_i_limit = 0x10000;     // 1 A
+static const fixed32_t selftest_i_rest = 0x1999;       // 0.1 A with switches off
+static const fixed32_t selftest_i_response = 0x051e;   // 20 mA
+static const fixed32_t selftest_v_response = 0x1999;   // 0.1 V
+static const fixed32_t selftest_v_source = 0x10000;    // 1 V
+static const uint16_t selftest_rail = 0xff0;
+static const uint32_t selftest_conversion_us = 30; // 108 ADCCLK cycles
+
+static uint16_t to_codes(uint32_t gain, fixed32_t x)
+{
+  return ((uint64_t) gain * x) >> 16;
+}
+
+// a conversion that never completes reads as the rail, which classifies
+// as a sense failure
+static uint16_t self_test_read(uint8_t ch)
+{
+  uint16_t code;
+  return read_regular(ch, &code) ? 0xfff : code;
+}
+
+static uint16_t absdiff(uint16_t a, uint16_t b)
+{
+  return a > b ? a - b : b - a;
+}
+
+// analog watchdog on the current sense, from adc1_isr: switch off at once
+static void self_test_cut(void)
+{
+  adc_disable_awd_interrupt(ADC1);
+  ADC1_SR = ~ADC_SR_AWD;
+  selftest_cut_code = adc_read_regular(ADC1);
+  selftest_reg->duty1 = selftest_reg->duty2 = 0;
+  selftest_reg->update_duty_func();
+  selftest_cut = true;
+}
+
+/*
+ * The control loop samples only once per millisecond, too slow to limit
+ * a pulse into a short. During the pulse the current sense is converted
+ * back-to-back as regular conversions under the analog watchdog, which
+ * cuts the pulse within a conversion or two of the current passing the
+ * limit.
+ */
+static void watch_current(uint8_t ich, uint16_t i_limit)
+{
+  static uint8_t seq[1];
+  seq[0] = ich;
+  selftest_cut = false;
+  adc_set_regular_sequence(ADC1, 1, seq);
+  adc_enable_analog_watchdog_on_selected_channel(ADC1, ich);
+  adc_set_watchdog_low_threshold(ADC1, 0);
+  adc_set_watchdog_high_threshold(ADC1, i_limit);
+  ADC1_SR = ~ADC_SR_AWD;
+  adc_enable_analog_watchdog_regular(ADC1);
+  adc_enable_awd_interrupt(ADC1);
+  adc_set_continuous_conversion_mode(ADC1);
+  adc_start_conversion_regular(ADC1);
+}
+
+static void unwatch_current(void)
+{
+  adc_disable_awd_interrupt(ADC1);
+  adc_disable_analog_watchdog_regular(ADC1);
+  adc_set_single_conversion_mode(ADC1);
+  // let the conversion in flight finish so it can't pass for the next
+  uint32_t start = uptime_us();
+  while (uptime_us() - start < selftest_conversion_us);
+  ADC1_SR = ~(ADC_SR_AWD | ADC_SR_EOC);
+}
+
+static void self_test_switch(struct regulator_t *reg, enum selftest_switch sw,
+                             fract32_t d1, fract32_t d2)
+{
+  uint8_t vch, ich;
+  sense_channels(reg, &vch, &ich);
+  uint16_t i_limit = to_codes(reg->isense_gain, selftest_i_limit);
+
+  reg->duty1 = reg->duty2 = 0;
+  regulator_set_mode(reg, CONST_DUTY);
+  delay_ms(selftest_settle_ms);
+  selftest.sw[sw].v_off = selftest.sw[sw].v_on = self_test_read(vch);
+  selftest.sw[sw].i_off = selftest.sw[sw].i_on = self_test_read(ich);
+
+  selftest_reg = reg;
+  watch_current(ich, i_limit);
+  reg->duty1 = d1;
+  reg->duty2 = d2;
+  reg->update_duty_func();
+  for (unsigned int ms=0; ms<selftest_pulse_ms && !selftest_cut; ms++)
+    delay_ms(1);
+  unwatch_current();
+  selftest_reg = NULL;
+
+  if (selftest_cut) {
+    selftest.failures |= SELFTEST_SHORT(sw);
+    selftest.sw[sw].i_on = selftest_cut_code;
+    selftest.sw[sw].v_on = self_test_read(vch);
+  } else {
+    selftest.sw[sw].v_on = self_test_read(vch);
+    selftest.sw[sw].i_on = self_test_read(ich);
+  }
+  regulator_set_mode(reg, DISABLED);
+  reg->duty1 = reg->duty2 = 0;
+}
+
+// whether the pulse on sw moved the sense inputs away from ref
+static bool self_test_responded(struct regulator_t *reg, enum selftest_switch sw,
+                                uint16_t v_ref, uint16_t i_ref)
+{
+  return absdiff(selftest.sw[sw].i_on, i_ref) >= to_codes(reg->isense_gain, selftest_i_response)
+    || absdiff(selftest.sw[sw].v_on, v_ref) >= to_codes(reg->vsense_gain, selftest_v_response);
+}
+
+/*
+ * Classify the channel from its two pulses. The second switch of a
+ * channel is judged against the first (channel 1's B only conducts
+ * together with A) or against rest (channel 2's two sides).
+ */
+static void self_test_classify(struct regulator_t *reg, enum selftest_switch a,
+                               enum selftest_switch b, bool b_after_a, uint16_t no_source)
+{
+  uint16_t i_rest = to_codes(reg->isense_gain, selftest_i_rest);
+
+  if (selftest.sw[a].i_off >= selftest_rail || selftest.sw[b].i_off >= selftest_rail) {
+    selftest.failures |= SELFTEST_NO_SENSE_SUPPLY;
+    return;
+  }
+  if (selftest.sw[a].i_off > i_rest || selftest.sw[b].i_off > i_rest)
+    selftest.failures |= SELFTEST_SHORT(a) | SELFTEST_SHORT(b);
+  if (selftest.sw[a].v_off < to_codes(reg->vsense_gain, selftest_v_source)) {
+    selftest.failures |= no_source;
+    return;
+  }
+
+  if (!self_test_responded(reg, a, selftest.sw[a].v_off, selftest.sw[a].i_off))
+    selftest.failures |= SELFTEST_OPEN(a);
+  if (b_after_a ? !self_test_responded(reg, b, selftest.sw[a].v_on, selftest.sw[a].i_on)
+                : !self_test_responded(reg, b, selftest.sw[b].v_off, selftest.sw[b].i_off))
+    selftest.failures |= SELFTEST_OPEN(b);
+}
+
+int regulator_self_test(void)
+{
+  if (chan1.mode != DISABLED || chan2.mode != DISABLED)
+    return -1;
+#if CONFIG_CAPTURE
+  // the pulses use the regular conversions
+  if (capture_busy())
+    return -1;
+#endif
+
+  enum tim_oc_id saved_oc = ch2_oc;
+  selftest.failures = 0;
+  self_test_switch(&chan1, SELFTEST_CH1_A, selftest_duty, 0);
+  self_test_switch(&chan1, SELFTEST_CH1_B, selftest_duty, selftest_duty);
+  ch2_oc = TIM_OC1;
+  self_test_switch(&chan2, SELFTEST_CH2_BATT, selftest_duty, 0);
+  ch2_oc = TIM_OC3;
+  self_test_switch(&chan2, SELFTEST_CH2_PANEL, selftest_duty, 0);
+  ch2_oc = saved_oc;
+
+  self_test_classify(&chan1, SELFTEST_CH1_A, SELFTEST_CH1_B, true, SELFTEST_CH1_NO_SOURCE);
+  self_test_classify(&chan2, SELFTEST_CH2_BATT, SELFTEST_CH2_PANEL, false, SELFTEST_CH2_NO_SOURCE);
+
+  // every switch silent while both channels have a source: the sense
+  // amplifiers are unpowered rather than all four switches open
+  const uint16_t all_open = SELFTEST_OPEN(SELFTEST_CH1_A) | SELFTEST_OPEN(SELFTEST_CH1_B)
+    | SELFTEST_OPEN(SELFTEST_CH2_BATT) | SELFTEST_OPEN(SELFTEST_CH2_PANEL);
+  if ((selftest.failures & all_open) == all_open)
+    selftest.failures = (selftest.failures & ~all_open) | SELFTEST_NO_SENSE_SUPPLY;
+
+  return selftest.failures;
+}
+
+const struct selftest_result *regulator_get_self_test(void)
+{
+  return &selftest;
+}
+
 void regulator_init(void)
 {
+#if CONFIG_GAIN_SCHEDULE
+  schedule_init(&chan1.schedule);
+  schedule_init(&chan2.schedule);
+#endif
   regulator_set_mode(&chan1, DISABLED);
   regulator_set_mode(&chan2, DISABLED);
 }
 
+// compare values must fit the 16-bit timers, and channel 1's phase
+// offset needs room below the period
+static bool period_valid(unsigned int period)
+{
+  return period > 0x20 && period <= 0xffff;
+}
+
 int regulator_set_period(struct regulator_t *reg, unsigned int period)
 {
-  if (reg->mode != DISABLED)
+  if (reg->mode != DISABLED || !period_valid(period))
     return -1;
   reg->period = period;
   return 0;
@@ -501,3 +1156,252 @@ unsigned int regulator_get_period(struct regulator_t *reg)
 {
   return reg->period;
 }
+
+unsigned int regulator_get_switching_frequency(struct regulator_t *reg)
+{
+  // center-aligned: the counter runs up and down once per switching period
+  return CLOCKRATE / (2 * reg->period);
+}
+
+void regulator_get_sense_gains(struct regulator_t *reg,
+                               uint32_t *vsense_gain, uint32_t *isense_gain)
+{
+  *vsense_gain = reg->vsense_gain;
+  *isense_gain = reg->isense_gain;
+}
+
+#if CONFIG_CAPTURE
+int regulator_start_ripple_capture(struct regulator_t *reg, bool current,
+                                   uint16_t *buf, unsigned int n)
+{
+  uint32_t timer = reg == &chan1 ? TIM2 : TIM3;
+  uint8_t vch, ich;
+  sense_channels(reg, &vch, &ich);
+
+  if (reg->mode == DISABLED || capture_busy())
+    return -1;
+
+  // wait for the down-count so that the start below is at the turn
+  // from down to up; the bound covers a full period at 16 bit
+  for (unsigned int i=0; !(TIM_CR1(timer) & TIM_CR1_DIR_DOWN); i++)
+    if (i > 0x10000) return -1;
+  cm_disable_interrupts();
+  for (unsigned int i=0; TIM_CR1(timer) & TIM_CR1_DIR_DOWN; i++) {
+    if (i > 0x10000) {
+      cm_enable_interrupts();
+      return -1;
+    }
+  }
+  int ret = capture_start(current ? ich : vch, buf, n);
+  cm_enable_interrupts();
+  return ret;
+}
+#endif
+
+#if CONFIG_BIQUAD
+/*******************************
+ * Error filters
+ *******************************/
+int regulator_add_filter(struct regulator_t *reg, const struct biquad *section)
+{
+  nvic_disable_irq(NVIC_ADC1_IRQ);
+  int ret = biquad_chain_add(&reg->error_filter, section);
+  nvic_enable_irq(NVIC_ADC1_IRQ);
+  return ret;
+}
+
+void regulator_clear_filters(struct regulator_t *reg)
+{
+  nvic_disable_irq(NVIC_ADC1_IRQ);
+  reg->error_filter.n = 0;
+  biquad_chain_reset(&reg->error_filter);
+  nvic_enable_irq(NVIC_ADC1_IRQ);
+}
+
+unsigned int regulator_get_filter_count(struct regulator_t *reg)
+{
+  return reg->error_filter.n;
+}
+#endif
+
+#if CONFIG_BENCH
+/*******************************
+ * Benchmark hooks
+ *******************************/
+static void update_duty_none(void) { }
+
+/* Run one feedback iteration of reg in the given mode on a scratch copy,
+ * leaving the live channel and the timers untouched. */
+void regulator_bench_feedback(struct regulator_t *reg, enum feedback_mode mode)
+{
+  struct regulator_t tmp = *reg;
+  tmp.mode = mode;
+  tmp.update_duty_func = update_duty_none;
+  regulator_feedback(&tmp);
+}
+
+/* Rewrite channel 1's current switch 1 compare value */
+void regulator_bench_pwm(void)
+{
+  set_pwm_duty(TIM2, TIM_OC3, chan1.period, chan1.duty1);
+}
+#endif
+
+/*******************************
+ * Checkpointing
+ *******************************/
+static const uint8_t state_version = 2;
+
+// the fields a record carries besides the mode and channel 2's source
+struct operating_point {
+  uint32_t period;
+  fract32_t duty1, duty2;
+  uint16_t isetpoint, vlimit, vsetpoint, ilimit;
+  struct feedback_gains v_gains, i_gains;
+  int32_t last_error;
+};
+
+static void get_point(const struct regulator_t *reg, struct operating_point *op)
+{
+  op->period = reg->period;
+  op->duty1 = reg->duty1;
+  op->duty2 = reg->duty2;
+  op->isetpoint = reg->isetpoint;
+  op->vlimit = reg->vlimit;
+  op->vsetpoint = reg->vsetpoint;
+  op->ilimit = reg->ilimit;
+  op->v_gains = reg->v_gains;
+  op->i_gains = reg->i_gains;
+  op->last_error = reg->last_error;
+}
+
+static void set_point(struct regulator_t *reg, const struct operating_point *op)
+{
+  reg->period = op->period;
+  reg->duty1 = op->duty1;
+  reg->duty2 = op->duty2;
+  reg->isetpoint = op->isetpoint;
+  reg->vlimit = op->vlimit;
+  reg->vsetpoint = op->vsetpoint;
+  reg->ilimit = op->ilimit;
+  reg->v_gains = op->v_gains;
+  reg->i_gains = op->i_gains;
+  reg->last_error = op->last_error;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+  p[0] = v; p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+  p = put_u16(p, v);
+  return put_u16(p, v >> 16);
+}
+
+static const uint8_t *get_u16(const uint8_t *p, uint16_t *v)
+{
+  *v = p[0] | (p[1] << 8);
+  return p + 2;
+}
+
+static const uint8_t *get_u32(const uint8_t *p, uint32_t *v)
+{
+  uint16_t lo, hi;
+  p = get_u16(p, &lo);
+  p = get_u16(p, &hi);
+  *v = lo | ((uint32_t) hi << 16);
+  return p;
+}
+
+int regulator_save_state(struct regulator_t *reg, void *buf, unsigned int len)
+{
+  uint8_t *p = buf;
+  if (len < REGULATOR_STATE_SIZE) return -1;
+  *p++ = state_version;
+  *p++ = reg->mode;
+  *p++ = reg == &chan2 && ch2_oc == TIM_OC1 ? BATTERY : INPUT;
+  p = put_u32(p, reg->period);
+  p = put_u32(p, reg->duty1);
+  p = put_u32(p, reg->duty2);
+  p = put_u16(p, reg->isetpoint);
+  p = put_u16(p, reg->vlimit);
+  p = put_u16(p, reg->vsetpoint);
+  p = put_u16(p, reg->ilimit);
+  p = put_u32(p, reg->v_gains.prop_gain1);
+  p = put_u32(p, reg->v_gains.prop_gain2);
+  p = put_u32(p, reg->i_gains.prop_gain1);
+  p = put_u32(p, reg->i_gains.prop_gain2);
+  p = put_u32(p, reg->last_error);
+  return p - (uint8_t *) buf;
+}
+
+bool regulator_state_changed(const void *a, const void *b)
+{
+  const uint8_t *p = a, *q = b;
+  const unsigned int duty = 7, setpoints = duty + 8, error = REGULATOR_STATE_SIZE - 4;
+  bool loop_duty = p[1] != DISABLED && p[1] != CONST_DUTY;
+  return memcmp(p, q, duty) != 0
+    || (!loop_duty && memcmp(p + duty, q + duty, setpoints - duty) != 0)
+    || memcmp(p + setpoints, q + setpoints, error - setpoints) != 0;
+}
+
+int regulator_restore_state(struct regulator_t *reg, const void *buf, unsigned int len)
+{
+  const uint8_t *p = buf;
+  struct operating_point op, prev;
+  uint32_t v[4];
+  if (len < REGULATOR_STATE_SIZE) return -1;
+  if (p[0] != state_version || p[1] > MPC_FB || p[2] > INPUT) return -2;
+  enum feedback_mode mode = p[1];
+  enum ch2_source_t source = p[2];
+  p += 3;
+
+  p = get_u32(p, &op.period);
+  p = get_u32(p, &v[0]);
+  p = get_u32(p, &v[1]);
+  op.duty1 = v[0];
+  op.duty2 = v[1];
+  p = get_u16(p, &op.isetpoint);
+  p = get_u16(p, &op.vlimit);
+  p = get_u16(p, &op.vsetpoint);
+  p = get_u16(p, &op.ilimit);
+  for (int i=0; i<4; i++)
+    p = get_u32(p, &v[i]);
+  op.v_gains.prop_gain1 = v[0];
+  op.v_gains.prop_gain2 = v[1];
+  op.i_gains.prop_gain1 = v[2];
+  op.i_gains.prop_gain2 = v[3];
+  p = get_u32(p, &v[0]);
+  op.last_error = v[0];
+
+  // a corrupt record must not reach the timers or the loop
+  if (!period_valid(op.period) || op.duty1 > 0xffff || op.duty2 > op.duty1
+      || op.vsetpoint > op.vlimit || op.isetpoint > op.ilimit)
+    return -2;
+  enum tim_oc_id oc = reg == &chan2 ? (source == BATTERY ? TIM_OC1 : TIM_OC3) : ch2_oc;
+  if (mode_refused(reg, mode, oc))
+    return -3;
+
+  // configuring the timers can still fail, so keep what to go back to
+  enum feedback_mode prev_mode = reg->mode;
+  enum ch2_source_t prev_source = ch2_oc == TIM_OC1 ? BATTERY : INPUT;
+  get_point(reg, &prev);
+
+  regulator_set_mode(reg, DISABLED);
+  int ret = reg == &chan2 ? regulator_set_ch2_source(source) : 0;
+  if (ret == 0) {
+    set_point(reg, &op);
+    ret = regulator_set_mode(reg, mode);
+  }
+  if (ret == 0)
+    return 0;
+
+  set_point(reg, &prev);
+  if (reg == &chan2)
+    regulator_set_ch2_source(prev_source);
+  regulator_set_mode(reg, prev_mode);
+  return -3;
+}
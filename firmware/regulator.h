@@ -1,3 +1,6 @@
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef int fixed32_t; // 16.16 fixed point
 typedef int fract32_t; // 16.16 fixed point (for now)
 
@@ -6,7 +9,8 @@ extern struct regulator_t chan1;
 extern struct regulator_t chan2;
 
 enum feedback_mode {
-  DISABLED, CONST_DUTY, CURRENT_FB, VOLTAGE_FB, MAX_POWER
+  DISABLED, CONST_DUTY, CURRENT_FB, VOLTAGE_FB, MAX_POWER,
+  MPC_FB // experimental, channel 1 only
 };
 
 enum ch2_source_t { BATTERY, INPUT };
@@ -30,7 +34,138 @@ fixed32_t regulator_get_vsense(struct regulator_t *reg);
 
 fixed32_t regulator_get_isense(struct regulator_t *reg);
 
+// current limit of the voltage feedback and power tracking modes
+fixed32_t regulator_get_ilimit(struct regulator_t *reg);
+
 int regulator_set_ch2_source(enum ch2_source_t src);
 
+/*
+ * Checkpointing
+ *
+ * A channel's operating point and loop state can be serialized into a
+ * compact, versioned little-endian record and restored later, e.g. across
+ * a reset. Restoring re-enters the saved mode; a record with an invalid
+ * period, duty cycle or setpoint, or a mode the channel refuses, is
+ * rejected without touching the channel. Should the channel fail to
+ * configure, its previous operating point and mode are put back.
+ */
+#define REGULATOR_STATE_SIZE 43
+
+// returns number of bytes written or -1 if buffer is too small
+int regulator_save_state(struct regulator_t *reg, void *buf, unsigned int len);
+// returns 0 on success, -1 if the buffer is short, -2 if the record is invalid,
+// -3 if the channel cannot enter the saved mode
+int regulator_restore_state(struct regulator_t *reg, const void *buf, unsigned int len);
+// whether two records differ in more than the duty cycle and error the
+// feedback modes move every sample
+bool regulator_state_changed(const void *a, const void *b);
+
+/*
+ * Error filters
+ *
+ * A chain of up to BIQUAD_MAX_SECTIONS biquads applied to the feedback
+ * error of the voltage and current loops. Coefficients are designed for
+ * REGULATOR_LOOP_RATE; a channel with filters keeps the loop at full rate.
+ */
+struct biquad;
+int regulator_add_filter(struct regulator_t *reg, const struct biquad *section);
+void regulator_clear_filters(struct regulator_t *reg);
+unsigned int regulator_get_filter_count(struct regulator_t *reg);
+
+/*
+ * Gain schedule
+ *
+ * Feedback gains are scaled by a Q8.8 factor (0x100 = 1.0) bilinearly
+ * interpolated from a grid of nodes: duty1 nodes at 0, 0x4000, ..., 0x10000
+ * and vsense nodes every 1024 codepoints.
+ */
+#define SCHEDULE_DUTY_NODES 5
+#define SCHEDULE_VSENSE_NODES 5
+
+int regulator_set_schedule_node(struct regulator_t *reg, unsigned int duty_node,
+                                unsigned int vsense_node, unsigned int scale);
+unsigned int regulator_get_schedule_node(struct regulator_t *reg, unsigned int duty_node,
+                                         unsigned int vsense_node);
+void regulator_enable_schedule(struct regulator_t *reg, bool enabled);
+// factor currently applied
+unsigned int regulator_get_schedule_scale(struct regulator_t *reg);
+
+// used by the bench command
+void regulator_bench_feedback(struct regulator_t *reg, enum feedback_mode mode);
+void regulator_bench_pwm(void);
+
+// energy delivered by the channel since boot in joules
+uint32_t regulator_get_energy(struct regulator_t *reg);
+
+// board temperature from the thermistor, returns 0 on success
+int regulator_get_temperature(int *decicelsius);
+
+/*
+ * Self-test
+ *
+ * With both channels disabled, each switch is pulsed at low duty for a
+ * few milliseconds while its channel's sense inputs are read, with the
+ * pulse cut short by the analog watchdog if the current passes a limit. A
+ * channel whose switches or sense fail (or that has not been tested)
+ * refuses the feedback modes; constant duty stays available for bench
+ * work. A channel without a source, e.g. a panel at night, has its
+ * switches checked for shorts only and is not locked out.
+ */
+enum selftest_switch {
+  SELFTEST_CH1_A,      // TIM2_CH3
+  SELFTEST_CH1_B,      // TIM4_CH3, pulsed together with A
+  SELFTEST_CH2_BATT,   // TIM3_CH1
+  SELFTEST_CH2_PANEL,  // TIM3_CH3
+  SELFTEST_SWITCHES
+};
+
+// failure bits
+#define SELFTEST_OPEN(sw)        (1 << (sw))       // no response to a pulse
+#define SELFTEST_SHORT(sw)       (1 << (4 + (sw))) // current while off, or over limit
+#define SELFTEST_NO_SENSE_SUPPLY (1 << 8)          // current sense at the rail or dead
+#define SELFTEST_CH1_NO_SOURCE   (1 << 9)          // no voltage on channel 1, informational
+#define SELFTEST_CH2_NO_SOURCE   (1 << 10)         // no voltage on channel 2, informational
+#define SELFTEST_NOT_RUN         (1 << 15)
+
+struct selftest_result {
+  uint16_t failures;
+  struct {
+    uint16_t v_off, i_off;  // codepoints before the pulse
+    uint16_t v_on, i_on;    // codepoints at the end of the pulse
+  } sw[SELFTEST_SWITCHES];
+};
+
+// returns the failure bits, or -1 if a channel is enabled
+int regulator_self_test(void);
+const struct selftest_result *regulator_get_self_test(void);
+
+// full control loop rate in Hz, the TIM7 trigger derives from it
+#define REGULATOR_LOOP_RATE 1000
+
+// current control loop rate in Hz
+unsigned int regulator_get_loop_rate(void);
+
+// called from the control loop interrupt after every sample, keep it short
+typedef void (*on_sample_cb)(void);
+extern on_sample_cb on_sample;
+// time until the next control loop sample, large if both channels are off
+unsigned int regulator_get_loop_slack_us(void);
+
 int regulator_set_period(struct regulator_t *reg, unsigned int period);
 unsigned int regulator_get_period(struct regulator_t *reg);
+unsigned int regulator_get_switching_frequency(struct regulator_t *reg); // Hz
+
+// sense scale factors in codepoints per volt and per amp
+void regulator_get_sense_gains(struct regulator_t *reg,
+                               uint32_t *vsense_gain, uint32_t *isense_gain);
+
+/*
+ * Ripple capture
+ *
+ * Starts a burst capture (see capture.h) of the channel's voltage or
+ * current sense at the bottom of its PWM carrier, so that successive
+ * bursts line up with the switching waveform. Interrupts are held off
+ * for up to half a switching period. Returns 0 if started.
+ */
+int regulator_start_ripple_capture(struct regulator_t *reg, bool current,
+                                   uint16_t *buf, unsigned int n);
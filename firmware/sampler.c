@@ -0,0 +1,102 @@
+#include "sampler.h"
+#include "telemetry.h"
+#include "clock.h"
+#include "usart.h"
+
+#define RAM_BASE 0x20000000
+#define RAM_SIZE 0x2800
+#define HEADER 9  // type and time_us
+
+struct entry {
+  uint32_t address;
+  uint8_t size;
+};
+
+static struct entry entries[SAMPLER_ENTRIES];
+static unsigned int num_entries;
+static unsigned int frame_len = HEADER;
+static uint32_t period_ms;
+static uint32_t last_ms;
+
+int sampler_add(uint32_t address, unsigned int size)
+{
+  if (num_entries == SAMPLER_ENTRIES || size == 0
+      || address < RAM_BASE || size > RAM_SIZE || address - RAM_BASE > RAM_SIZE - size
+      || frame_len + size > TELEMETRY_MAX_FRAME)
+    return -1;
+  entries[num_entries].address = address;
+  entries[num_entries].size = size;
+  frame_len += size;
+  return num_entries++;
+}
+
+void sampler_clear(void)
+{
+  num_entries = 0;
+  frame_len = HEADER;
+}
+
+void sampler_set_period(unsigned int ms)
+{
+  period_ms = ms;
+  last_ms = msTicks;
+}
+
+static unsigned int copy(uint8_t *dst, const struct entry *e)
+{
+  uint32_t v;
+  if (e->size == 4 && e->address % 4 == 0)
+    v = *(volatile uint32_t *) e->address;
+  else if (e->size == 2 && e->address % 2 == 0)
+    v = *(volatile uint16_t *) e->address;
+  else if (e->size == 1)
+    v = *(volatile uint8_t *) e->address;
+  else {
+    for (unsigned int i=0; i<e->size; i++)
+      dst[i] = ((volatile uint8_t *) e->address)[i];
+    return e->size;
+  }
+
+  for (unsigned int i=0; i<e->size; i++)
+    dst[i] = v >> (8*i);
+  return e->size;
+}
+
+void sampler_poll(void)
+{
+  if (!period_ms || !num_entries || msTicks - last_ms < period_ms)
+    return;
+  last_ms = msTicks - last_ms < 2 * period_ms ? last_ms + period_ms : msTicks;
+
+  uint8_t frame[TELEMETRY_MAX_FRAME];
+  uint64_t t = monotonic_us();
+  frame[0] = TELEMETRY_FRAME_SAMPLER;
+  for (unsigned int i=0; i<8; i++)
+    frame[1+i] = t >> (8*i);
+
+  unsigned int len = HEADER;
+  for (unsigned int i=0; i<num_entries; i++)
+    len += copy(&frame[len], &entries[i]);
+  telemetry_send(frame, len);
+}
+
+void sampler_report(void)
+{
+  char buf[12];
+  usart_print("period = ");
+  itoa(buf, 6, period_ms);
+  usart_print(buf);
+  usart_print(" ms\n");
+  for (unsigned int i=0; i<num_entries; i++) {
+    itoa(buf, 1, i);
+    usart_print(buf);
+    usart_print(" 0x");
+    for (int shift=28; shift>=0; shift-=4)
+      buf[(28-shift)/4] = "0123456789abcdef"[(entries[i].address >> shift) & 0xf];
+    buf[8] = '\0';
+    usart_print(buf);
+    itoa(buf, 3, entries[i].size);
+    usart_print(buf);
+    usart_print("\n");
+  }
+}
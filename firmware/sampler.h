@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+/*
+ * Live variable sampler
+ *
+ * Copies a list of RAM locations into telemetry frames at a fixed period,
+ * from the main loop rather than an interrupt, for a live view of any
+ * variable without a console command per field. Names are resolved to
+ * addresses on the host from the symbols of solar-charger.elf. Frames
+ * carry the values back to back in list order:
+ *
+ *   type (1)  time_us (8)  values ...
+ *
+ * Aligned 1, 2 and 4 byte locations are read in one access; longer ones
+ * are copied byte by byte and may tear against interrupt updates.
+ */
+
+#define SAMPLER_ENTRIES 8
+
+// returns the entry index, or -1 if the range is outside RAM or the frame is full
+int sampler_add(uint32_t address, unsigned int size);
+void sampler_clear(void);
+// 0 stops sampling
+void sampler_set_period(unsigned int period_ms);
+
+// sample when due, call periodically from the main loop
+void sampler_poll(void);
+
+void sampler_report(void);
@@ -0,0 +1,126 @@
+#include "sensors.h"
+#include "i2c_bus.h"
+#include "clock.h"
+#include "usart.h"
+
+#include <stddef.h>
+
+struct sensor {
+  const char *name, *unit;
+  uint8_t address, reg;
+  uint16_t period_ms;
+  int32_t (*convert)(const uint8_t *raw);
+};
+
+struct sensor_state {
+  struct i2c_transaction tx;
+  uint8_t raw[2];
+  uint32_t last_ms;
+  volatile int32_t value;
+  volatile bool valid;
+  int32_t min, max;
+  uint32_t reads, errors;
+};
+
+static int32_t be16(const uint8_t *raw)
+{
+  return (int16_t) (raw[0] << 8 | raw[1]);
+}
+
+// 10 uV LSB across 10 mOhm
+static int32_t ina219_shunt_ma(const uint8_t *raw) { return be16(raw); }
+// 4 mV LSB above the three flag bits, unsigned unlike the shunt voltage
+static int32_t ina219_bus_mv(const uint8_t *raw) { return ((raw[0] << 8 | raw[1]) >> 3) * 4; }
+// 1/16 C LSB, left justified in 16 bits
+static int32_t tmp102_dc(const uint8_t *raw) { return (be16(raw) >> 4) * 10 / 16; }
+
+static const struct sensor sensors[N_SENSORS] = {
+  [SENSOR_BATT_MA] = { "batt current", " mA",   0x40, 0x01,  100, ina219_shunt_ma },
+  [SENSOR_BATT_MV] = { "batt voltage", " mV",   0x40, 0x02,  100, ina219_bus_mv },
+  [SENSOR_TEMP]    = { "temperature ", " dC",   0x48, 0x00, 1000, tmp102_dc },
+};
+
+static struct sensor_state state[N_SENSORS];
+
+// interrupt context
+static void read_done(struct i2c_transaction *t)
+{
+  struct sensor_state *s = (struct sensor_state *) t;
+  const struct sensor *sensor = &sensors[s - state];
+  if (t->status != I2C_OK) {
+    s->valid = false;
+    s->errors++;
+    return;
+  }
+
+  int32_t v = sensor->convert(s->raw);
+  if (!s->reads || v < s->min) s->min = v;
+  if (!s->reads || v > s->max) s->max = v;
+  s->reads++;
+  s->value = v;
+  s->valid = true;
+}
+
+void sensors_poll(void)
+{
+  for (unsigned int i=0; i<N_SENSORS; i++) {
+    const struct sensor *sensor = &sensors[i];
+    struct sensor_state *s = &state[i];
+    if (s->tx.status == I2C_PENDING || msTicks - s->last_ms < sensor->period_ms)
+      continue;
+    s->last_ms = msTicks;
+
+    s->tx.address = sensor->address;
+    s->tx.write = &sensor->reg;
+    s->tx.write_len = 1;
+    s->tx.read = s->raw;
+    s->tx.read_len = sizeof(s->raw);
+    s->tx.done = read_done;
+    i2c_bus_submit(&s->tx);
+  }
+  i2c_bus_poll();
+}
+
+int sensors_get_value(enum sensor_id id, int32_t *value)
+{
+  if (id >= N_SENSORS || !state[id].valid)
+    return -1;
+  *value = state[id].value;
+  return 0;
+}
+
+// sign and five digits
+static void print_signed(int32_t v)
+{
+  char buf[8];
+  buf[0] = v < 0 ? '-' : ' ';
+  itoa(&buf[1], 5, v < 0 ? -v : v);
+  usart_print(buf);
+}
+
+void sensors_report(void)
+{
+  char buf[8];
+  usart_print("sensor        value    min    max     reads errors\n");
+  for (unsigned int i=0; i<N_SENSORS; i++) {
+    const struct sensor_state *s = &state[i];
+    usart_print(sensors[i].name);
+    usart_print(" ");
+    if (s->valid)
+      print_signed(s->value);
+    else
+      usart_print("    --");
+    usart_print(" ");
+    print_signed(s->min);
+    usart_print(" ");
+    print_signed(s->max);
+    usart_print(sensors[i].unit);
+    usart_print(" ");
+    itoa(buf, 6, s->reads);
+    usart_print(buf);
+    usart_print(" ");
+    itoa(buf, 6, s->errors);
+    usart_print(buf);
+    usart_print("\n");
+  }
+}
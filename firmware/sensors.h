@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * I2C sensors
+ *
+ * Off-board sensors on the LED expander's bus, each read register by
+ * register at its own period through the shared transaction queue, so
+ * polling never waits on the bus. Each reading is converted and cached
+ * with running statistics; telemetry and the console read the cache.
+ * A sensor that does not answer is marked invalid and retried at its
+ * period.
+ */
+
+enum sensor_id {
+  SENSOR_BATT_MA,   // INA219 shunt on the battery lead, mA
+  SENSOR_BATT_MV,   // INA219 bus voltage, mV
+  SENSOR_TEMP,      // TMP102 enclosure temperature, 0.1 C
+  N_SENSORS
+};
+
+// read what is due, call periodically from the main loop
+void sensors_poll(void);
+
+// latest value, returns 0 if valid
+int sensors_get_value(enum sensor_id id, int32_t *value);
+
+void sensors_report(void);
@@ -3,10 +3,26 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/exti.h>
 
+#include "config.h"
 #include "clock.h"
 #include "usart.h"
 #include "regulator.h"
 #include "io_expander.h"
+#include "power.h"
+#include "bench.h"
+#include "pool.h"
+#include "kv.h"
+#include "eeprom.h"
+#include "biquad.h"
+#include "lighting.h"
+#include "analytics.h"
+#include "arcfault.h"
+#include "health.h"
+#include "telemetry.h"
+#include "sampler.h"
+#include "jobs.h"
+#include "sensors.h"
+#include "i2c_bus.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -25,12 +41,85 @@ const char* help_message = \
   "si=(I)            set current setpoint in milliamps\n"
   "v                 get sense voltage\n"
   "i                 get sense current\n"
-  "m[pivDd]          set regulator mode\n"
+  "h                 get harvested energy per channel\n"
+#if CONFIG_KV
+  "H                 get lifetime harvested energy per channel\n"
+#endif
+#if CONFIG_POWER
+  "e                 get MCU power and energy estimate\n"
+#endif
+#if CONFIG_BIQUAD
+  "f                 get number of error filter sections\n"
+  "fl=(FC),(Q)       add low-pass section, Q in hundredths\n"
+  "fn=(F0),(Q)       add notch section, Q in hundredths\n"
+  "fL=(FZ),(FP)      add lead-lag section\n"
+  "fc                clear error filters\n"
+#endif
+#if CONFIG_GAIN_SCHEDULE
+  "g                 get applied gain schedule factor\n"
+  "g(D)(V)           get gain schedule node\n"
+  "g(D)(V)=(S)       set gain schedule node, S = 256 for unity\n"
+  "g[ed]             enable/disable gain schedule\n"
+#endif
+#if CONFIG_LIGHTING
+  "L                 get lighting state\n"
+  "L=(I),(C)         drive LEDs on channel 2 at I milliamps, battery C watt-hours\n"
+  "                  channel 1 must be enabled, it senses dusk and dawn\n"
+  "Ld                disable lighting\n"
+  "Lc                check the battery charge estimate\n"
+#endif
+#if CONFIG_ANALYTICS
+  "a                 get panel degradation and soiling report\n"
+#endif
+#if CONFIG_ARCFAULT
+  "A                 get arc-fault detector status\n"
+  "Ar                re-arm arc-fault detector\n"
+  "Ai=<codes>        inject test noise into arc-fault captures\n"
+#endif
+#if CONFIG_HEALTH
+  "C                 get output capacitor and inductor health\n"
+#endif
+#if CONFIG_TELEMETRY
+  "T                 list telemetry subscriptions\n"
+  "T+(F),(P),[smx]   subscribe to field F every P ms\n"
+  "                  s = sample, m = mean, x = min/max\n"
+  "T-(ID)            unsubscribe, all if no ID\n"
+  "Tb                send the boot timing frame\n"
+#endif
+#if CONFIG_SAMPLER
+  "S                 list sampled RAM locations\n"
+  "S+(ADDR),(SIZE)   sample SIZE bytes at ADDR (0x for hex)\n"
+  "S-                clear sampled locations\n"
+  "Sp=(P)            sample every P ms, 0 to stop\n"
+#endif
+#if CONFIG_SENSORS
+  "I                 get I2C sensor readings\n"
+#endif
+  "l                 get control loop rate\n"
+  "selftest          test the switching stage (channels must be disabled)\n"
+#if CONFIG_JOBS
+  "@(ID) (JOB) [ARGS] start background job, answered with @(ID) lines\n"
+  "                  iv = I-V sweep of channel 1, selftest, kvsync\n"
+  "@(ID) cancel      cancel a job\n"
+  "jobs              list running jobs\n"
+#endif
+#if CONFIG_KV
+  "kv                get key-value store status\n"
+#endif
+  "t                 get device time in microseconds\n"
+#if CONFIG_BENCH
+  "bench             run micro-benchmarks\n"
+#endif
+  "m[pivDMd]         set regulator mode\n"
   "                  p = maximum power mode\n                     "
   "                  i = current feedback mode\n"
   "                  v = voltage feedback mode\n"
   "                  D = constant duty cycle mode\n"
+#if CONFIG_MPC
+  "                  M = explicit MPC mode (experimental, channel 1)\n"
+#endif
   "                  d = disabled\n"
+  "pool              get message buffer pool usage\n"
   "?                 disable help message\n"
   "";
 static const char* const modes[] = {
@@ -38,22 +127,11 @@ static const char* const modes[] = {
   "constant duty cycle",
   "constant current",
   "constant voltage",
-  "maximum power"
+  "maximum power",
+  "explicit mpc"
 };
   
 
-char* itoa(char* str, unsigned int len, unsigned int val)
-{
-  unsigned int i;
-  for (i=1; i <= len; i++) {
-    str[len-i] = (val % 10) + '0';
-    val /= 10;
-  }
-
-  str[i-1] = '\0';
-  return &str[i-1];
-}
-
 char* fixed32_to_a(char* str, unsigned int len, fixed32_t val)
 {
   return itoa(str, len, val);
@@ -63,6 +141,31 @@ char* fixed32_to_a(char* str, unsigned int len, fixed32_t val)
   return itoa(&tmp[1], len, 0xffff & val);
 }
 
+/*
+ * Console responses are built in a single pool block. Everything written
+ * to one goes through these, so an overlong response is truncated rather
+ * than running off the end of the block.
+ */
+static const uint32_t pool_wait_ms = 100;
+
+static void resp_cat(char* resp, const char* s)
+{
+  strncat(resp, s, POOL_BLOCK_SIZE - 1 - strlen(resp));
+}
+
+static void resp_cpy(char* resp, const char* s)
+{
+  resp[0] = '\0';
+  resp_cat(resp, s);
+}
+
+static void resp_uint(char* resp, unsigned int len, unsigned int val)
+{
+  char buf[12];
+  itoa(buf, len > 10 ? 10 : len, val);
+  resp_cat(resp, buf);
+}
+
 void handle_line_recv(const char* line, unsigned int length)
 {
   usart_write(line, length);
@@ -118,6 +221,199 @@ void init_pins(void)
 void led7_off(void) { gpio_set(GPIOA, GPIO0); }
 void led7_on(void) { gpio_clear(GPIOA, GPIO0); }
 
+#if CONFIG_BOOT_ANIMATION
+/*
+ * Boot animation
+ *
+ * Stepped from the console idle loop so that it never delays bringing up
+ * the regulators or the console: a chase through the expander LEDs
+ * followed by three blinks of LED7.
+ */
+static unsigned int boot_anim_step;
+static uint32_t boot_anim_next;
+
+static void boot_animation_step(void)
+{
+  if ((int32_t) (msTicks - boot_anim_next) < 0)
+    return;
+
+  if (boot_anim_step < 7) {
+    if (boot_anim_step > 0)
+      set_led(boot_anim_step - 1, led_off);
+    set_led(boot_anim_step, led_on);
+  } else if (boot_anim_step == 7) {
+    set_led(6, led_off);
+    led7_on();
+  } else if (boot_anim_step < 13) {
+    if (boot_anim_step % 2) led7_on();
+    else led7_off();
+  } else if (boot_anim_step == 13) {
+    led7_off();
+  } else {
+    return;
+  }
+
+  boot_anim_step++;
+  boot_anim_next = msTicks + 100;
+}
+#endif
+
+/* Background work, run whenever the console is waiting for input */
+#if CONFIG_KV
+/*
+ * Lifetime harvested energy: the totals from before this boot plus the
+ * regulator's counters, saved to the store every energy_save_ms.
+ */
+static const uint32_t energy_save_ms = 600000;
+static uint32_t energy_base[2];
+static uint32_t last_energy_save_ms;
+
+static uint32_t lifetime_energy(unsigned int ch)
+{
+  return energy_base[ch] + regulator_get_energy(ch ? &chan2 : &chan1);
+}
+
+static void load_energy(void)
+{
+  if (kv_get(KV_ENERGY_CH1, &energy_base[0], 4) != 4)
+    energy_base[0] = 0;
+  if (kv_get(KV_ENERGY_CH2, &energy_base[1], 4) != 4)
+    energy_base[1] = 0;
+}
+
+static void save_energy(void)
+{
+  if (msTicks - last_energy_save_ms < energy_save_ms)
+    return;
+  last_energy_save_ms = msTicks;
+  uint32_t e1 = lifetime_energy(0), e2 = lifetime_energy(1);
+  kv_set(KV_ENERGY_CH1, &e1, 4);
+  kv_set(KV_ENERGY_CH2, &e2, 4);
+}
+
+/*
+ * Operating points: each channel's checkpoint is restored at boot and
+ * saved again whenever its mode, source or settings change.
+ */
+static const uint32_t point_check_ms = 1000;
+static uint8_t saved_point[2][REGULATOR_STATE_SIZE];
+static uint32_t last_point_check_ms;
+
+static void load_points(void)
+{
+  uint8_t buf[REGULATOR_STATE_SIZE];
+  for (unsigned int ch=0; ch<2; ch++) {
+    struct regulator_t *reg = ch ? &chan2 : &chan1;
+    if (kv_get(KV_POINT_CH1 + ch, buf, sizeof(buf)) == sizeof(buf))
+      regulator_restore_state(reg, buf, sizeof(buf));
+    regulator_save_state(reg, saved_point[ch], sizeof(saved_point[ch]));
+  }
+}
+
+static void save_points(void)
+{
+  uint8_t buf[REGULATOR_STATE_SIZE];
+  if (msTicks - last_point_check_ms < point_check_ms)
+    return;
+  last_point_check_ms = msTicks;
+  for (unsigned int ch=0; ch<2; ch++) {
+    regulator_save_state(ch ? &chan2 : &chan1, buf, sizeof(buf));
+    if (regulator_state_changed(saved_point[ch], buf)
+        && kv_set(KV_POINT_CH1 + ch, buf, sizeof(buf)) == 0)
+      memcpy(saved_point[ch], buf, sizeof(buf));
+  }
+}
+#endif
+
+static void idle_tasks(void)
+{
+#if CONFIG_BOOT_ANIMATION
+  boot_animation_step();
+#endif
+#if CONFIG_LIGHTING
+  lighting_poll();
+#endif
+#if CONFIG_ANALYTICS
+  analytics_poll();
+#endif
+#if CONFIG_ARCFAULT
+  arcfault_poll();
+#endif
+#if CONFIG_HEALTH
+  health_poll();
+#endif
+#if CONFIG_TELEMETRY
+  telemetry_poll();
+#endif
+#if CONFIG_SAMPLER
+  sampler_poll();
+#endif
+#if CONFIG_JOBS
+  jobs_poll();
+#endif
+#if CONFIG_SENSORS
+  sensors_poll();
+#else
+  i2c_bus_poll();
+#endif
+#if CONFIG_KV
+  save_energy();
+  save_points();
+  kv_poll();
+#endif
+#if CONFIG_EEPROM
+  eeprom_poll();
+#endif
+}
+
+static void print_self_test(void)
+{
+  static const char *const switches[SELFTEST_SWITCHES] = {
+    "ch1 A    ", "ch1 B    ", "ch2 batt ", "ch2 panel",
+  };
+  const struct selftest_result *r = regulator_get_self_test();
+  char buf[8];
+
+  usart_print(r->failures ? "self-test: FAIL " : "self-test: pass ");
+  itoa(buf, 5, r->failures);
+  usart_print(buf);
+  usart_print("\nswitch     v_off i_off  v_on  i_on\n");
+  for (unsigned int sw=0; sw<SELFTEST_SWITCHES; sw++) {
+    usart_print(switches[sw]);
+    itoa(buf, 6, r->sw[sw].v_off);
+    usart_print(buf);
+    itoa(buf, 6, r->sw[sw].i_off);
+    usart_print(buf);
+    itoa(buf, 6, r->sw[sw].v_on);
+    usart_print(buf);
+    itoa(buf, 6, r->sw[sw].i_on);
+    usart_print(buf);
+    if (r->failures & SELFTEST_OPEN(sw))
+      usart_print("  open");
+    if (r->failures & SELFTEST_SHORT(sw))
+      usart_print("  short");
+    usart_print("\n");
+  }
+  if (r->failures & SELFTEST_NO_SENSE_SUPPLY)
+    usart_print("no sense amplifier supply\n");
+  if (r->failures & SELFTEST_CH1_NO_SOURCE)
+    usart_print("channel 1 not connected\n");
+  if (r->failures & SELFTEST_CH2_NO_SOURCE)
+    usart_print("channel 2 not connected\n");
+}
+
+// time spent in each boot phase, in the order of TELEMETRY_BOOT_PHASES
+static uint32_t boot_us[TELEMETRY_BOOT_PHASES];
+
+static void print_boot_time(const char* name, uint32_t us)
+{
+  char buf[16];
+  usart_print(name);
+  itoa(buf, 10, us);
+  usart_print(buf);
+  usart_print(" us\n");
+}
+
 int main(void)
 {
   const clock_scale_t* clk = &clock_config[CLOCK_VRANGE1_HSI_RAW_16MHZ];
@@ -126,42 +422,105 @@ int main(void)
   //PWR_CR = (PWR_CR & ~(0x7 << 5)) | (0x6 << 5) | PWR_CR_PVDE; // PVD = 3.1V
   //exti_enable_request(EXTI16); // PVD interrupt
   init_systick();
+  init_us_clock();
+  uint32_t t_clock = uptime_us();
 
   rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_GPIOAEN);
   rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_GPIOBEN);
 
   init_pins();
-  init_buttons();
-
-  // cycle through LEDs
-  for (int i=0; i<7; i++) {
-    set_led(i, led_on);
-    delay_ms(100);
-    set_led(i, led_off);
-  }
-    
-  for (int i=0; i<3; i++) {
-    led7_on();
-    delay_ms(100);
-    led7_off();
-    delay_ms(100);
-  }
+  led7_off();
+  uint32_t t_pins = uptime_us();
 
   regulator_init();
+  uint32_t t_regulator = uptime_us();
+
+#if CONFIG_KV
+  kv_init();
+  load_energy();
+#endif
+  uint32_t t_storage = uptime_us();
+
+  regulator_self_test();
+  uint32_t t_selftest = uptime_us();
+#if CONFIG_KV
+  // the feedback modes wait for the self-test
+  load_points();
+#endif
 
   //gpio_mode_setup(GPIOB, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO10);
   //gpio_clear(GPIOB, GPIO10);
 
   on_line_recv = handle_line_recv;
   configure_usart();
+  init_buttons();
+  uint32_t t_usart = uptime_us();
+#if CONFIG_TELEMETRY
+  telemetry_init();
+#endif
+
+  boot_us[0] = t_clock;
+  boot_us[1] = t_pins - t_clock;
+  boot_us[2] = t_regulator - t_pins;
+  boot_us[3] = t_storage - t_regulator;
+  boot_us[4] = t_selftest - t_storage;
+  boot_us[5] = t_usart - t_selftest;
+
   usart_print("hello world!\n");
+  print_boot_time("boot: clock     ", boot_us[0]);
+  print_boot_time("boot: pins      ", boot_us[1]);
+  print_boot_time("boot: regulator ", boot_us[2]);
+  print_boot_time("boot: storage   ", boot_us[3]);
+  print_boot_time("boot: self-test ", boot_us[4]);
+  print_boot_time("boot: usart     ", boot_us[5]);
+  print_boot_time("boot: total     ", t_usart);
+  print_self_test();
+#if CONFIG_TELEMETRY
+  telemetry_send_boot(boot_us);
+#endif
+
+#if CONFIG_BOOT_ANIMATION
+  boot_anim_step = 0;
+  boot_anim_next = msTicks;
+#endif
+  on_idle = idle_tasks;
 
   char cmd[256];
   struct regulator_t* reg = &chan1;
   while (true) {
     usart_print("> ");
     usart_readline(cmd, 256);
-    if (cmd[0] == 'd') {
+
+    // the response is built in a pool block and handed to the UART DMA;
+    // blocks come back as the DMA drains, so a free one is not far off
+    struct pool_block* out;
+    uint32_t wait_start = msTicks;
+    while ((out = pool_alloc()) == NULL && msTicks - wait_start < pool_wait_ms);
+    if (out == NULL) {
+      usart_print("error: no buffer\n");
+      continue;
+    }
+    char* resp = out->data;
+    resp[0] = '\0';
+
+    if (strncmp(cmd, "pool", 4) == 0) {
+      pool_report();
+#if CONFIG_JOBS
+    } else if (cmd[0] == '@') {
+      jobs_request(&cmd[1]);
+    } else if (strncmp(cmd, "jobs", 4) == 0) {
+      jobs_report();
+#endif
+#if CONFIG_KV
+    } else if (strncmp(cmd, "kv", 2) == 0) {
+      kv_report();
+#endif
+    } else if (strncmp(cmd, "selftest", 8) == 0) {
+      if (regulator_self_test() < 0)
+        resp_cpy(resp, "disable both channels first\n");
+      else
+        print_self_test();
+    } else if (cmd[0] == 'd') {
       fract32_t duty1 = regulator_get_duty_cycle_1(reg);
       fract32_t duty2 = regulator_get_duty_cycle_2(reg);
       bool set = false;
@@ -177,13 +536,13 @@ int main(void)
       if (set)
         ret = regulator_set_duty_cycle(reg, duty1, duty2);
       if (ret) {
-        strcpy(cmd, "error: wrong mode\n");
+        resp_cpy(resp, "error: wrong mode\n");
       } else {
-        strcpy(cmd, "duty1 = ");
-        itoa(&cmd[strlen(cmd)], 10, duty1);
-        strcat(cmd, ", duty2 = ");
-        itoa(&cmd[strlen(cmd)], 10, duty2);
-        strcat(cmd, "\n");
+        resp_cpy(resp, "duty1 = ");
+        resp_uint(resp, 10, duty1);
+        resp_cat(resp, ", duty2 = ");
+        resp_uint(resp, 10, duty2);
+        resp_cat(resp, "\n");
       }
     } else if (cmd[0] == 'p') {
       if (cmd[1] == '=') {
@@ -193,9 +552,9 @@ int main(void)
           regulator_set_period(reg, period);
         regulator_set_mode(reg, CONST_DUTY);
       }
-      strcpy(cmd, "period = ");
-      itoa(&cmd[strlen(cmd)], 10, regulator_get_period(reg));
-      strcat(cmd, "\n");
+      resp_cpy(resp, "period = ");
+      resp_uint(resp, 10, regulator_get_period(reg));
+      resp_cat(resp, "\n");
     } else if (cmd[0] == 's' && cmd[1] == 'v') {
       if (cmd[2] == '=') {
         fixed32_t setpoint = strtol(&cmd[3], NULL, 10);
@@ -203,9 +562,9 @@ int main(void)
       }
 
       fixed32_t setpoint = regulator_get_vsetpoint(reg);
-      strcpy(cmd, "voltage setpoint = ");
-      itoa(&cmd[strlen(cmd)], 10, setpoint * 1000 / 0xffff);
-      strcat(cmd, "\n");
+      resp_cpy(resp, "voltage setpoint = ");
+      resp_uint(resp, 10, setpoint * 1000 / 0xffff);
+      resp_cat(resp, "\n");
     } else if (cmd[0] == 's' && cmd[1] == 'i') {
       if (cmd[2] == '=') {
         fixed32_t setpoint = strtol(&cmd[3], NULL, 10);
@@ -213,27 +572,206 @@ int main(void)
       }
 
       fixed32_t setpoint = regulator_get_isetpoint(reg);
-      strcpy(cmd, "current setpoint = ");
-      itoa(&cmd[strlen(cmd)], 10, setpoint * 1000 / 0xffff);
-      strcat(cmd, "\n");
+      resp_cpy(resp, "current setpoint = ");
+      resp_uint(resp, 10, setpoint * 1000 / 0xffff);
+      resp_cat(resp, "\n");
     } else if (cmd[0] == 'v') {
       fixed32_t vsense = regulator_get_vsense(reg);
-      strcpy(cmd, "vsense = ");
-      fixed32_to_a(&cmd[strlen(cmd)], 10, vsense * 1000 / 0xffff);
-      strcat(cmd, "\n");
+      resp_cpy(resp, "vsense = ");
+      char buf[12];
+      fixed32_to_a(buf, 10, vsense * 1000 / 0xffff);
+      resp_cat(resp, buf);
+      resp_cat(resp, "\n");
     } else if (cmd[0] == 'i') {
       fixed32_t isense = regulator_get_isense(reg);
-      strcpy(cmd, "isense = ");
-      fixed32_to_a(&cmd[strlen(cmd)], 10, isense * 1000 / 0xffff);
-      strcat(cmd, "\n");
+      resp_cpy(resp, "isense = ");
+      char buf[12];
+      fixed32_to_a(buf, 10, isense * 1000 / 0xffff);
+      resp_cat(resp, buf);
+      resp_cat(resp, "\n");
+#if CONFIG_POWER
+    } else if (cmd[0] == 'e') {
+      resp[0] = '\0';
+      power_report();
+#endif
+#if CONFIG_BENCH
+    } else if (strncmp(cmd, "bench", 5) == 0) {
+      resp[0] = '\0';
+      bench_run();
+#endif
+    } else if (cmd[0] == 't') {
+      resp_cpy(resp, "t = ");
+      char buf[24];
+      format_timestamp(buf, monotonic_us());
+      resp_cat(resp, buf);
+      resp_cat(resp, "\n");
+#if CONFIG_BIQUAD
+    } else if (cmd[0] == 'f') {
+      int ret = 0;
+      if (cmd[1] == 'c') {
+        regulator_clear_filters(reg);
+      } else if (cmd[1] != '\0' && cmd[2] == '=') {
+        char* temp;
+        struct biquad bq;
+        uint32_t f1 = strtol(&cmd[3], &temp, 10);
+        uint32_t f2 = temp[0] == ',' ? strtol(&temp[1], NULL, 10) : 0;
+        if (f1 == 0 || f2 == 0 || 2 * f1 >= REGULATOR_LOOP_RATE)
+          ret = 1;
+        else if (cmd[1] == 'l')
+          ret = biquad_design_lowpass(&bq, f1, REGULATOR_LOOP_RATE, f2);
+        else if (cmd[1] == 'n')
+          ret = biquad_design_notch(&bq, f1, REGULATOR_LOOP_RATE, f2);
+        else if (cmd[1] == 'L' && 2 * f2 < REGULATOR_LOOP_RATE)
+          ret = biquad_design_lead_lag(&bq, f1, f2, REGULATOR_LOOP_RATE);
+        else
+          ret = 1;
+        if (!ret)
+          ret = regulator_add_filter(reg, &bq);
+      }
+      if (ret)
+        resp_cpy(resp, "error\n");
+      resp_cat(resp, "filter sections = ");
+      resp_uint(resp, 1, regulator_get_filter_count(reg));
+      resp_cat(resp, "\n");
+#endif
+#if CONFIG_GAIN_SCHEDULE
+    } else if (cmd[0] == 'g') {
+      if (cmd[1] == 'e' || cmd[1] == 'd') {
+        regulator_enable_schedule(reg, cmd[1] == 'e');
+      } else if (cmd[1] >= '0' && cmd[1] <= '9' && cmd[2] >= '0' && cmd[2] <= '9') {
+        unsigned int d = cmd[1] - '0', v = cmd[2] - '0';
+        if (cmd[3] == '=' && regulator_set_schedule_node(reg, d, v, strtol(&cmd[4], NULL, 10)))
+          resp_cpy(resp, "error\n");
+        resp_cat(resp, "node = ");
+        resp_uint(resp, 5, regulator_get_schedule_node(reg, d, v));
+        resp_cat(resp, "\n");
+      }
+      resp_cat(resp, "gain factor = ");
+      resp_uint(resp, 5, regulator_get_schedule_scale(reg));
+      resp_cat(resp, "\n");
+#endif
+    } else if (cmd[0] == 'h') {
+      resp_cpy(resp, "energy1 = ");
+      resp_uint(resp, 10, regulator_get_energy(&chan1));
+      resp_cat(resp, " J, energy2 = ");
+      resp_uint(resp, 10, regulator_get_energy(&chan2));
+      resp_cat(resp, " J\n");
+#if CONFIG_KV
+    } else if (cmd[0] == 'H') {
+      resp_cpy(resp, "lifetime1 = ");
+      resp_uint(resp, 10, lifetime_energy(0));
+      resp_cat(resp, " J, lifetime2 = ");
+      resp_uint(resp, 10, lifetime_energy(1));
+      resp_cat(resp, " J\n");
+#endif
+#if CONFIG_LIGHTING
+    } else if (cmd[0] == 'L') {
+      static const char* const lighting_states[] = { "off", "day", "night" };
+      int ret = 0;
+      if (cmd[1] == 'd') {
+        lighting_disable();
+      } else if (cmd[1] == 'c') {
+        resp_cpy(resp, lighting_check() ? "charge check: FAIL\n" : "charge check: pass\n");
+      } else if (cmd[1] == '=') {
+        char* temp;
+        uint32_t rated = strtol(&cmd[2], &temp, 10);
+        uint32_t capacity = temp[0] == ',' ? strtol(&temp[1], NULL, 10) : 0;
+        ret = lighting_enable(rated, capacity);
+      }
+      if (ret)
+        resp_cpy(resp, "error\n");
+      resp_cat(resp, "lighting = ");
+      resp_cat(resp, lighting_states[lighting_get_state()]);
+      resp_cat(resp, ", level = ");
+      resp_uint(resp, 3, lighting_get_level());
+      resp_cat(resp, "%, soc = ");
+      resp_uint(resp, 3, lighting_get_soc());
+      resp_cat(resp, "%\n");
+#endif
+#if CONFIG_ANALYTICS
+    } else if (cmd[0] == 'a') {
+      analytics_report();
+#endif
+#if CONFIG_ARCFAULT
+    } else if (cmd[0] == 'A') {
+      if (cmd[1] == 'r') {
+        arcfault_rearm();
+        resp_cpy(resp, "re-armed\n");
+      } else if (cmd[1] == 'i' && cmd[2] == '=') {
+        arcfault_inject(strtol(&cmd[3], NULL, 10));
+      } else {
+        arcfault_report();
+      }
+#endif
+#if CONFIG_HEALTH
+    } else if (cmd[0] == 'C') {
+      health_report();
+#endif
+#if CONFIG_TELEMETRY
+    } else if (cmd[0] == 'T') {
+      if (cmd[1] == '+') {
+        char* temp;
+        unsigned int field = strtol(&cmd[2], &temp, 10);
+        unsigned int period = temp[0] == ',' ? strtol(&temp[1], &temp, 10) : 0;
+        enum telemetry_method method = TM_SAMPLE;
+        if (temp[0] == ',' && temp[1] == 'm')
+          method = TM_MEAN;
+        else if (temp[0] == ',' && temp[1] == 'x')
+          method = TM_MINMAX;
+        int id = telemetry_subscribe(field, period, method);
+        if (id < 0) {
+          resp_cpy(resp, "failed\n");
+        } else {
+          resp_cpy(resp, "id = ");
+          resp_uint(resp, 1, id);
+          resp_cat(resp, "\n");
+        }
+      } else if (cmd[1] == '-') {
+        if (cmd[2] >= '0' && cmd[2] <= '9') {
+          if (telemetry_unsubscribe(strtol(&cmd[2], NULL, 10)))
+            resp_cpy(resp, "failed\n");
+        } else {
+          telemetry_unsubscribe_all();
+        }
+      } else if (cmd[1] == 'b') {
+        if (telemetry_send_boot(boot_us))
+          resp_cpy(resp, "failed\n");
+      } else {
+        telemetry_report();
+      }
+#endif
+#if CONFIG_SAMPLER
+    } else if (cmd[0] == 'S') {
+      if (cmd[1] == '+') {
+        char* temp;
+        uint32_t address = strtoul(&cmd[2], &temp, 0);
+        unsigned int size = temp[0] == ',' ? strtol(&temp[1], NULL, 10) : 0;
+        if (sampler_add(address, size) < 0)
+          resp_cpy(resp, "failed\n");
+      } else if (cmd[1] == '-') {
+        sampler_clear();
+      } else if (cmd[1] == 'p' && cmd[2] == '=') {
+        sampler_set_period(strtol(&cmd[3], NULL, 10));
+      } else {
+        sampler_report();
+      }
+#endif
+#if CONFIG_SENSORS
+    } else if (cmd[0] == 'I') {
+      sensors_report();
+#endif
+    } else if (cmd[0] == 'l') {
+      resp_cpy(resp, "loop rate = ");
+      resp_uint(resp, 10, regulator_get_loop_rate());
+      resp_cat(resp, " Hz\n");
     } else if (cmd[0] == 'r') {
       if (cmd[1] == '1')
         reg = &chan1;
       else if (cmd[1] == '2')
         reg = &chan2;
-      strcpy(cmd, "channel ");
-      strcat(cmd, reg == &chan1 ? "1" : "2");
-      strcat(cmd, " selected\n");
+      resp_cpy(resp, "channel ");
+      resp_cat(resp, reg == &chan1 ? "1" : "2");
+      resp_cat(resp, " selected\n");
     } else if (cmd[0] == 'm') {
       enum feedback_mode mode = regulator_get_mode(reg);
       bool set = true;
@@ -247,27 +785,30 @@ int main(void)
         mode = VOLTAGE_FB;
       } else if (cmd[1] == 'D') {
         mode = CONST_DUTY;
+      } else if (cmd[1] == 'M') {
+        mode = MPC_FB;
       } else {
         set = false;
       }
 
-      cmd[0] = 0;
+      resp[0] = 0;
       if (set) {
         if (regulator_set_mode(reg, mode))
-          strcat(cmd, "error\n");
+          resp_cat(resp, "error\n");
       }
 
-      strcat(cmd, "mode = ");
-      strcat(cmd, modes[mode]);
-      strcat(cmd, "\n");
+      resp_cat(resp, "mode = ");
+      resp_cat(resp, modes[mode]);
+      resp_cat(resp, "\n");
     } else if (cmd[0] == '?') {
-      cmd[0] = '\0';
+      resp[0] = '\0';
       usart_print(help_message);
     } else {
-      strcpy(cmd, "error\n");
+      resp_cpy(resp, "error\n");
     }
 
-    usart_print(cmd);
+    out->len = strlen(resp);
+    usart_send_block(out);
   }
 
   while(true) {}
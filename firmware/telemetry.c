@@ -0,0 +1,334 @@
+#include <libopencm3/cm3/nvic.h>
+
+#include "telemetry.h"
+#include "regulator.h"
+#include "clock.h"
+#include "usart.h"
+#include "pool.h"
+#include "sensors.h"
+#include "power.h"
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct subscription {
+  bool active;
+  uint8_t field, method;
+  uint16_t period_ms;
+  uint32_t last_ms;
+  int64_t sum;
+  int32_t min, max, latest;
+  uint32_t n;
+};
+
+static struct subscription subs[TELEMETRY_SUBSCRIPTIONS];
+static unsigned int frames_sent, frames_dropped;
+
+/*
+ * The control loop interrupt only latches the values that fall due at a
+ * sample into a small ring; telemetry_poll packs and sends them from the
+ * main loop. A sample that finds the ring full is dropped.
+ */
+struct latched_value {
+  uint8_t field, method;
+  int32_t v[2];  // sample or mean, or minimum and maximum
+};
+
+struct latch {
+  uint64_t time_us;
+  uint8_t mask;
+  struct latched_value values[TELEMETRY_SUBSCRIPTIONS];
+};
+
+#define LATCHES 4
+static struct latch latches[LATCHES];
+static unsigned int latch_head;  // advanced by the interrupt
+static unsigned int latch_tail;  // advanced by telemetry_poll
+static volatile unsigned int latches_dropped;
+
+static const uint8_t field_width[TELEMETRY_FIELDS] = {
+  [TF_VSENSE1] = 2, [TF_ISENSE1] = 2, [TF_VSENSE2] = 2, [TF_ISENSE2] = 2,
+  [TF_DUTY1] = 2, [TF_DUTY2] = 2,
+  [TF_POWER1] = 4, [TF_POWER2] = 4,
+  [TF_ENERGY1] = 4, [TF_ENERGY2] = 4,
+  [TF_LOOP_RATE] = 2,
+  [TF_BATT_MA] = 2, [TF_BATT_MV] = 2, [TF_TEMPERATURE] = 2,
+  [TF_MCU_POWER] = 4, [TF_MCU_ENERGY] = 4,
+};
+
+static int32_t milli(fixed32_t x)
+{
+  return ((int64_t) x * 1000) >> 16;
+}
+
+static int32_t read_sensor(int id)
+{
+  int32_t v = 0;
+#if CONFIG_SENSORS
+  sensors_get_value(id, &v);
+#else
+  (void) id;
+#endif
+  return v;
+}
+
+static int32_t read_field(enum telemetry_field f)
+{
+  switch (f) {
+  case TF_VSENSE1: return milli(regulator_get_vsense(&chan1));
+  case TF_ISENSE1: return milli(regulator_get_isense(&chan1));
+  case TF_VSENSE2: return milli(regulator_get_vsense(&chan2));
+  case TF_ISENSE2: return milli(regulator_get_isense(&chan2));
+  case TF_DUTY1: return regulator_get_duty_cycle_1(&chan1);
+  case TF_DUTY2: return regulator_get_duty_cycle_1(&chan2);
+  case TF_POWER1:
+    return milli(((int64_t) regulator_get_vsense(&chan1) * regulator_get_isense(&chan1)) >> 16);
+  case TF_POWER2:
+    return milli(((int64_t) regulator_get_vsense(&chan2) * regulator_get_isense(&chan2)) >> 16);
+  case TF_ENERGY1: return regulator_get_energy(&chan1);
+  case TF_ENERGY2: return regulator_get_energy(&chan2);
+  case TF_LOOP_RATE: return regulator_get_loop_rate();
+  case TF_BATT_MA: return read_sensor(SENSOR_BATT_MA);
+  case TF_BATT_MV: return read_sensor(SENSOR_BATT_MV);
+  case TF_TEMPERATURE: return read_sensor(SENSOR_TEMP);
+#if CONFIG_POWER
+  case TF_MCU_POWER: return power_get_avg_uw();
+  case TF_MCU_ENERGY: return (uint64_t) power_get_avg_uw() * 86400 / 1000000;
+#endif
+  default: return 0;
+  }
+}
+
+// COBS: replaces zeros so that a zero byte can delimit frames
+static unsigned int cobs_encode(const uint8_t *in, unsigned int len, uint8_t *out)
+{
+  unsigned int code_pos = 0, o = 1;
+  uint8_t code = 1;
+  for (unsigned int i=0; i<len; i++) {
+    if (in[i] != 0) {
+      out[o++] = in[i];
+      code++;
+    }
+    if (in[i] == 0 || code == 0xff) {
+      out[code_pos] = code;
+      code_pos = o++;
+      code = 1;
+    }
+  }
+  out[code_pos] = code;
+  return o;
+}
+
+int telemetry_send(const uint8_t *frame, unsigned int len)
+{
+  uint8_t buf[TELEMETRY_MAX_FRAME + 2];
+  if (len > TELEMETRY_MAX_FRAME)
+    return -1;
+
+  struct pool_block *b = pool_alloc();
+  if (!b) {
+    frames_dropped++;
+    return -1;
+  }
+
+  uint16_t crc = crc16(0xffff, frame, len);
+  for (unsigned int i=0; i<len; i++)
+    buf[i] = frame[i];
+  buf[len] = crc;
+  buf[len+1] = crc >> 8;
+
+  b->len = cobs_encode(buf, len + 2, (uint8_t *) b->data);
+  b->data[b->len++] = 0;
+  usart_send_block(b);
+  frames_sent++;
+  return 0;
+}
+
+static unsigned int put(uint8_t *p, int64_t v, unsigned int width)
+{
+  for (unsigned int i=0; i<width; i++)
+    p[i] = v >> (8*i);
+  return width;
+}
+
+/*
+ * Frame under construction; a full one is sent and continued in a new
+ * frame with the same timestamp.
+ */
+struct frame {
+  uint8_t data[TELEMETRY_MAX_FRAME];
+  unsigned int len;
+  uint64_t time_us;
+};
+
+#define MASK 9  // offset of the subscription mask
+
+static void frame_start(struct frame *f)
+{
+  f->data[0] = TELEMETRY_FRAME_FIELDS;
+  put(&f->data[1], f->time_us, 8);
+  f->data[MASK] = 0;
+  f->len = MASK + 1;
+}
+
+static void frame_add(struct frame *f, const struct latched_value *lv, unsigned int id)
+{
+  unsigned int width = field_width[lv->field];
+  unsigned int size = lv->method == TM_MINMAX ? 2 * width : width;
+
+  if (f->len + size > TELEMETRY_MAX_FRAME) {
+    telemetry_send(f->data, f->len);
+    frame_start(f);
+  }
+
+  f->data[MASK] |= 1 << id;
+  f->len += put(&f->data[f->len], lv->v[0], width);
+  if (lv->method == TM_MINMAX)
+    f->len += put(&f->data[f->len], lv->v[1], width);
+}
+
+// interrupt context
+static void sample(void)
+{
+  struct latch *l = NULL;
+  bool full = false;
+  uint32_t now = msTicks;
+
+  for (unsigned int id=0; id<TELEMETRY_SUBSCRIPTIONS; id++) {
+    struct subscription *s = &subs[id];
+    if (!s->active) continue;
+
+    int32_t v = read_field(s->field);
+    s->latest = v;
+    s->sum += v;
+    if (s->n == 0 || v < s->min) s->min = v;
+    if (s->n == 0 || v > s->max) s->max = v;
+    s->n++;
+
+    if (now - s->last_ms < s->period_ms)
+      continue;
+    // keep the phase unless the loop has fallen a whole period behind
+    s->last_ms = now - s->last_ms < 2u * s->period_ms ? s->last_ms + s->period_ms : now;
+
+    if (!l && !full) {
+      if (latch_head - __atomic_load_n(&latch_tail, __ATOMIC_ACQUIRE) == LATCHES) {
+        full = true;
+        latches_dropped++;
+      } else {
+        l = &latches[latch_head % LATCHES];
+        l->time_us = monotonic_us();
+        l->mask = 0;
+      }
+    }
+    if (l) {
+      struct latched_value *lv = &l->values[id];
+      l->mask |= 1 << id;
+      lv->field = s->field;
+      lv->method = s->method;
+      lv->v[0] = s->method == TM_SAMPLE ? s->latest
+        : s->method == TM_MEAN ? s->sum / (int32_t) s->n : s->min;
+      lv->v[1] = s->max;
+    }
+    s->sum = 0;
+    s->n = 0;
+  }
+
+  if (l)
+    __atomic_store_n(&latch_head, latch_head + 1, __ATOMIC_RELEASE);
+}
+
+void telemetry_poll(void)
+{
+  while (latch_tail != __atomic_load_n(&latch_head, __ATOMIC_ACQUIRE)) {
+    const struct latch *l = &latches[latch_tail % LATCHES];
+    struct frame f;
+    f.time_us = l->time_us;
+    frame_start(&f);
+    for (unsigned int id=0; id<TELEMETRY_SUBSCRIPTIONS; id++)
+      if (l->mask & (1 << id))
+        frame_add(&f, &l->values[id], id);
+    telemetry_send(f.data, f.len);
+    __atomic_store_n(&latch_tail, latch_tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+int telemetry_send_boot(const uint32_t phase_us[TELEMETRY_BOOT_PHASES])
+{
+  uint8_t frame[9 + 4 * TELEMETRY_BOOT_PHASES];
+  frame[0] = TELEMETRY_FRAME_BOOT;
+  unsigned int len = 1 + put(&frame[1], monotonic_us(), 8);
+  for (unsigned int i=0; i<TELEMETRY_BOOT_PHASES; i++)
+    len += put(&frame[len], phase_us[i], 4);
+  return telemetry_send(frame, len);
+}
+
+int telemetry_subscribe(enum telemetry_field field, unsigned int period_ms,
+                        enum telemetry_method method)
+{
+  if (field >= TELEMETRY_FIELDS || method > TM_MINMAX || period_ms == 0 || period_ms > 0xffff)
+    return -1;
+
+  for (unsigned int id=0; id<TELEMETRY_SUBSCRIPTIONS; id++) {
+    struct subscription *s = &subs[id];
+    if (s->active) continue;
+    nvic_disable_irq(NVIC_ADC1_IRQ);
+    s->field = field;
+    s->method = method;
+    s->period_ms = period_ms;
+    s->last_ms = msTicks;
+    s->sum = 0;
+    s->n = 0;
+    s->active = true;
+    nvic_enable_irq(NVIC_ADC1_IRQ);
+    return id;
+  }
+  return -1;
+}
+
+int telemetry_unsubscribe(unsigned int id)
+{
+  if (id >= TELEMETRY_SUBSCRIPTIONS || !subs[id].active)
+    return -1;
+  subs[id].active = false;
+  return 0;
+}
+
+void telemetry_unsubscribe_all(void)
+{
+  for (unsigned int id=0; id<TELEMETRY_SUBSCRIPTIONS; id++)
+    subs[id].active = false;
+}
+
+void telemetry_init(void)
+{
+  on_sample = sample;
+}
+
+void telemetry_report(void)
+{
+  static const char *const methods[] = { "sample", "mean", "min/max" };
+  char buf[12];
+
+  usart_print("id field  period method\n");
+  for (unsigned int id=0; id<TELEMETRY_SUBSCRIPTIONS; id++) {
+    struct subscription *s = &subs[id];
+    if (!s->active) continue;
+    itoa(buf, 2, id);
+    usart_print(buf);
+    itoa(buf, 6, s->field);
+    usart_print(buf);
+    itoa(buf, 8, s->period_ms);
+    usart_print(buf);
+    usart_print(" ");
+    usart_print(methods[s->method]);
+    usart_print("\n");
+  }
+  usart_print("frames sent = ");
+  itoa(buf, 10, frames_sent);
+  usart_print(buf);
+  usart_print(", dropped = ");
+  itoa(buf, 10, frames_dropped + latches_dropped);
+  usart_print(buf);
+  usart_print("\n");
+}
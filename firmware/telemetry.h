@@ -0,0 +1,75 @@
+#include <stdint.h>
+
+/*
+ * Telemetry
+ *
+ * Fields are sampled in the control loop interrupt according to a table
+ * of subscriptions, each with its own period and decimation method. When
+ * subscriptions fall due their values are latched, and telemetry_poll
+ * packs them, at the field's width and in table order, into a binary
+ * frame:
+ *
+ *   type (1)  time_us (8)  subscription mask (1)  values ...  crc16 (2)
+ *
+ * time_us is monotonic_us, little-endian like all values. A boot frame is
+ * sent once after reset, and again on request, with the time spent in
+ * each boot phase:
+ *
+ *   type (1)  time_us (8)  phase_us (4) x TELEMETRY_BOOT_PHASES  crc16 (2)
+ *
+ * Frames are COBS encoded and terminated by a zero byte, which the text
+ * console never sends, and go out through the UART DMA queue. A frame
+ * that finds the buffer pool empty, or the latches full, is dropped.
+ * Nothing is sampled while both channels are disabled.
+ */
+
+enum telemetry_field {
+  TF_VSENSE1, TF_ISENSE1,  // mV, mA (2 bytes)
+  TF_VSENSE2, TF_ISENSE2,
+  TF_DUTY1, TF_DUTY2,      // duty cycle 1 of each channel (2 bytes)
+  TF_POWER1, TF_POWER2,    // mW (4 bytes)
+  TF_ENERGY1, TF_ENERGY2,  // J since boot (4 bytes)
+  TF_LOOP_RATE,            // Hz (2 bytes)
+  TF_BATT_MA, TF_BATT_MV,  // I2C sensors, 0 while unread (2 bytes)
+  TF_TEMPERATURE,          // 0.1 C (2 bytes)
+  TF_MCU_POWER,            // estimated MCU average, uW (4 bytes)
+  TF_MCU_ENERGY,           // the same as J per day (4 bytes)
+  TELEMETRY_FIELDS
+};
+
+enum telemetry_method {
+  TM_SAMPLE,  // latest value
+  TM_MEAN,    // mean over the period
+  TM_MINMAX,  // minimum then maximum over the period
+};
+
+// frame types, the first byte of every frame
+enum telemetry_frame_type {
+  TELEMETRY_FRAME_FIELDS = 1,
+  TELEMETRY_FRAME_SAMPLER,
+  TELEMETRY_FRAME_BOOT,
+};
+
+// clock, pins, regulator, storage, self-test, usart
+#define TELEMETRY_BOOT_PHASES 6
+
+#define TELEMETRY_SUBSCRIPTIONS 8
+// largest frame before CRC and encoding that fits a pool block
+#define TELEMETRY_MAX_FRAME 59
+
+// returns the subscription id or -1 if the table is full
+int telemetry_subscribe(enum telemetry_field field, unsigned int period_ms,
+                        enum telemetry_method method);
+// returns 0 on success
+int telemetry_unsubscribe(unsigned int id);
+void telemetry_unsubscribe_all(void);
+
+// append CRC, encode and queue a frame, returns 0 if queued
+int telemetry_send(const uint8_t *frame, unsigned int len);
+// returns 0 if queued
+int telemetry_send_boot(const uint32_t phase_us[TELEMETRY_BOOT_PHASES]);
+
+void telemetry_init(void);
+// send the frames latched since the last call, call from the main loop
+void telemetry_poll(void);
+void telemetry_report(void);
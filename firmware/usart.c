@@ -1,29 +1,156 @@
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
 #include "usart.h"
+#include "config.h"
+#include "power.h"
+#include "pool.h"
+
+#include <stddef.h>
 
 on_line_recv_cb on_line_recv;
+on_idle_cb on_idle;
 
 char rx_buf[255];
 unsigned int rx_head;
 
+/*
+ * DMA transmit queue
+ *
+ * Pool blocks passed to usart_send_block are transmitted by DMA1 channel 4
+ * straight out of the block, which is released once its transfer
+ * completes. The blocking writers below wait for the block in flight and
+ * hold back the rest of the queue, which the DMA interrupt stops chaining
+ * while they write, so a steady stream of queued blocks can't keep them
+ * waiting. Queued blocks follow once they are done.
+ */
+static struct pool_block *tx_queue[POOL_BLOCKS];
+static unsigned int tx_head, tx_count;
+static struct pool_block * volatile tx_current;
+static volatile bool tx_blocking;
+
+static void start_tx(struct pool_block *b)
+{
+  tx_current = b;
+  dma_channel_reset(DMA1, DMA_CHANNEL4);
+  dma_set_peripheral_address(DMA1, DMA_CHANNEL4, (uint32_t) &USART1_DR);
+  dma_set_memory_address(DMA1, DMA_CHANNEL4, (uint32_t) b->data);
+  dma_set_number_of_data(DMA1, DMA_CHANNEL4, b->len);
+  dma_set_read_from_memory(DMA1, DMA_CHANNEL4);
+  dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL4);
+  dma_set_peripheral_size(DMA1, DMA_CHANNEL4, DMA_CCR_PSIZE_8BIT);
+  dma_set_memory_size(DMA1, DMA_CHANNEL4, DMA_CCR_MSIZE_8BIT);
+  dma_set_priority(DMA1, DMA_CHANNEL4, DMA_CCR_PL_LOW);
+  dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL4);
+  dma_enable_channel(DMA1, DMA_CHANNEL4);
+}
+
+void usart_send_block(struct pool_block *b)
+{
+  if (b->len == 0) {
+    pool_release(b);
+    return;
+  }
+
+  cm_disable_interrupts();
+  if (tx_current == NULL && !tx_blocking) {
+    start_tx(b);
+  } else {
+    // at most POOL_BLOCKS blocks exist, so the queue cannot overflow
+    tx_queue[(tx_head + tx_count) % POOL_BLOCKS] = b;
+    tx_count++;
+  }
+  cm_enable_interrupts();
+}
+
+static bool interrupts_masked(void)
+{
+  uint32_t primask;
+  __asm__ volatile ("mrs %0, primask" : "=r" (primask));
+  return primask & 1;
+}
+
+/*
+ * Completion is normally handled by the DMA interrupt, which cannot run
+ * while interrupts are masked or from a handler that outranks it, so the
+ * wait services the transfer complete flag itself.
+ */
+void usart_flush(void)
+{
+  while (tx_current != NULL) {
+    bool masked = interrupts_masked();
+    cm_disable_interrupts();
+    if (dma_get_interrupt_flag(DMA1, DMA_CHANNEL4, DMA_TCIF))
+      dma1_channel4_isr();
+    if (!masked)
+      cm_enable_interrupts();
+  }
+}
+
+void dma1_channel4_isr(void)
+{
+  // already serviced by usart_flush
+  if (!dma_get_interrupt_flag(DMA1, DMA_CHANNEL4, DMA_TCIF))
+    return;
+  dma_clear_interrupt_flags(DMA1, DMA_CHANNEL4, DMA_TCIF);
+  dma_disable_channel(DMA1, DMA_CHANNEL4);
+  pool_release(tx_current);
+
+  if (tx_count && !tx_blocking) {
+    struct pool_block *b = tx_queue[tx_head];
+    tx_head = (tx_head + 1) % POOL_BLOCKS;
+    tx_count--;
+    start_tx(b);
+  } else {
+    tx_current = NULL;
+  }
+}
+
+static void begin_blocking(void)
+{
+  tx_blocking = true;
+  usart_flush();
+}
+
+static void end_blocking(void)
+{
+  cm_disable_interrupts();
+  tx_blocking = false;
+  if (tx_current == NULL && tx_count) {
+    struct pool_block *b = tx_queue[tx_head];
+    tx_head = (tx_head + 1) % POOL_BLOCKS;
+    tx_count--;
+    start_tx(b);
+  }
+  cm_enable_interrupts();
+}
+
 void usart_write(const char* c, unsigned int length)
 {
+  begin_blocking();
   for (unsigned int i=0; i<length; i++)
     usart_send_blocking(USART1, c[i]);
+  end_blocking();
 }
 
 void usart_print(const char* c)
 {
+  begin_blocking();
   for (const char* i = c; *i != 0; i++)
     usart_send_blocking(USART1, *i);
+  end_blocking();
 }
 
 unsigned int usart_readline(char* buffer, unsigned int length)
 {
   unsigned int i;
   for (i=0; i < length; i++) {
-    usart_wait_recv_ready(USART1);
+    while (!usart_get_flag(USART1, USART_SR_RXNE)) {
+      if (on_idle) on_idle();
+      power_sleep();
+    }
     buffer[i] = usart_recv(USART1);
     if (buffer[i] == '\n')
       break;
@@ -34,7 +161,7 @@ unsigned int usart_readline(char* buffer, unsigned int length)
 
 void configure_usart(void)
 {
-  rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_USART1EN);
+  power_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_USART1EN);
 
   usart_enable(USART1);
   usart_set_databits(USART1, 8);
@@ -43,6 +170,10 @@ void configure_usart(void)
   usart_set_mode(USART1, USART_MODE_TX_RX);
   usart_set_baudrate(USART1, 115200);
   usart_enable_rx_interrupt(USART1);
+
+  power_enable_clock(&RCC_AHBENR, RCC_AHBENR_DMA1EN);
+  nvic_enable_irq(NVIC_DMA1_CHANNEL4_IRQ);
+  usart_enable_tx_dma(USART1);
 }
 
 void usart1_isr(void)
@@ -59,3 +190,42 @@ void usart1_isr(void)
     }
   }
 }
+
+char* itoa(char* str, unsigned int len, unsigned int val)
+{
+  unsigned int i;
+  for (i=1; i <= len; i++) {
+    str[len-i] = (val % 10) + '0';
+    val /= 10;
+  }
+
+  str[i-1] = '\0';
+  return &str[i-1];
+}
+
+void print_value(const char *name, unsigned int val, const char *unit)
+{
+  char buf[12];
+  usart_print(name);
+  itoa(buf, 10, val);
+  usart_print(buf);
+  usart_print(unit);
+}
+
+char* format_timestamp(char* str, uint64_t us)
+{
+  char* end = itoa(str, 10, us / 1000000);
+  end[0] = '.';
+  return itoa(&end[1], 6, us % 1000000);
+}
+
+uint16_t crc16(uint16_t crc, const void *data, unsigned int len)
+{
+  const uint8_t *p = data;
+  while (len--) {
+    crc ^= (uint16_t) *p++ << 8;
+    for (unsigned int i=0; i<8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
@@ -1,7 +1,32 @@
+#include <stdint.h>
+
 void usart_write(const char* c, unsigned int length);
 unsigned int usart_readline(char* buffer, unsigned int length);
 void usart_print(const char* c);
+
+// queue a pool block for DMA transmission, taking over the caller's reference
+struct pool_block;
+void usart_send_block(struct pool_block *b);
+// wait for queued blocks to be sent, safe from any context; during a
+// blocking write only the block in flight
+void usart_flush(void);
 void configure_usart(void);
 
+// format val as len zero-padded decimal digits, returns end of string
+char* itoa(char* str, unsigned int len, unsigned int val);
+
+// print name, val as by itoa and unit, blocking
+void print_value(const char *name, unsigned int val, const char *unit);
+
+// format a microsecond timestamp as seconds.microseconds, returns end of string
+char* format_timestamp(char* str, uint64_t us);
+
+// CRC-16/CCITT-FALSE, continuing from crc (0xffff to start)
+uint16_t crc16(uint16_t crc, const void *data, unsigned int len);
+
 typedef void (*on_line_recv_cb)(const char* c, unsigned int length);
 extern on_line_recv_cb on_line_recv;
+
+// called on every wakeup while usart_readline waits for input
+typedef void (*on_idle_cb)(void);
+extern on_idle_cb on_idle;